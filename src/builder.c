@@ -0,0 +1,73 @@
+#include "builder.h"
+#include "object.h"
+#include "vm.h"
+
+#define RET_ERROR(...) \
+	{\
+		vmRuntimeError(__VA_ARGS__);\
+		NativeReturn result = { INTERPRET_RUNTIME_ERROR, NIL_VAL };\
+		return result;\
+	}
+
+#define RET_OK(val) \
+	{\
+		NativeReturn result = { INTERPRET_OK, val }; \
+		return result; \
+	}
+
+static NativeReturn createBuilder(int, Value*);
+static NativeReturn reserve(int, Value*);
+
+static NativeDef nativeFunctions[] = {
+	{ "stringBuilder", 0, createBuilder },
+	{ "reserve", 2, reserve },
+	{ NULL, -1, NULL }
+};
+
+void builderNativeFunctions(RegisterNative addToRegistry) {
+	NativeDef* current = &nativeFunctions[0];
+
+	while (current->name != NULL) {
+		addToRegistry(current++);
+	}
+}
+
+// Strings go in as they are, and numbers, booleans and nil the way
+// toString() writes them. Returns false for anything else. The builder
+// and the value must be reachable.
+bool appendToBuilder(ObjStringBuilder* builder, Value value) {
+	if (IS_STRING(value)) {
+		appendStringToBuilder(builder, AS_STRING(value));
+		return true;
+	}
+
+	char chars[FORMAT_BUFFER_SIZE];
+	int length = formatValue(value, chars);
+	if (length < 0) return false;
+
+	appendCharsToBuilder(builder, chars, length);
+	return true;
+}
+
+NativeReturn createBuilder(int argCount, Value* args) {
+	ObjStringBuilder* builder = newStringBuilder();
+
+	RET_OK(OBJ_VAL(builder));
+}
+
+NativeReturn reserve(int argCount, Value* args) {
+	if (!IS_STRING_BUILDER(args[0])) {
+		RET_ERROR("Expected a string builder as first argument.");
+	}
+	else if (!IS_INT(args[1]) && !IS_NUMBER(args[1])) {
+		RET_ERROR("Expected a number as second argument.");
+	}
+
+	int64_t capacity = IS_INT(args[1]) ? AS_INT(args[1]) : (int64_t)AS_NUMBER(args[1]);
+	if (capacity < 0 || capacity > INT32_MAX) {
+		RET_ERROR("Invalid capacity %lld.", (long long)capacity);
+	}
+
+	reserveStringBuilder(AS_STRING_BUILDER(args[0]), (int)capacity);
+	RET_OK(args[0]);
+}
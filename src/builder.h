@@ -0,0 +1,9 @@
+#ifndef vlox_builder_h
+#define vlox_builder_h
+
+#include "native.h"
+
+void builderNativeFunctions(RegisterNative);
+bool appendToBuilder(ObjStringBuilder*, Value);
+
+#endif // vlox_builder_h
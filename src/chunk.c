@@ -26,9 +26,10 @@ static void writeLineArray(LineArray* array, int line, int opCount) {
 		LineInfo info = { opCount, line };
 		if (array->capacity < (array->count + 1)) {
 			int oldCapacity = array->capacity;
-			array->capacity = GROW_CAPACITY(oldCapacity);
+			int capacity = GROW_CAPACITY(oldCapacity);
 			array->lines = GROW_ARRAY(LineInfo, array->lines,
-					oldCapacity, array->capacity);
+					oldCapacity, capacity);
+			array->capacity = capacity;
 		}
 		array->lines[array->count] = info;
 		array->count++;
@@ -53,9 +54,10 @@ void freeChunk(Chunk* chunk) {
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 	if (chunk->capacity < (chunk->count + 1)) {
 		int oldCapacity = chunk->capacity;
-		chunk->capacity = GROW_CAPACITY(oldCapacity);
+		int capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(uint8_t, chunk->code,
-				oldCapacity, chunk->capacity);
+				oldCapacity, capacity);
+		chunk->capacity = capacity;
 	}
 
 	chunk->code[chunk->count] = byte;
@@ -92,21 +94,31 @@ void addLine(Chunk* chunk, int line, int opCount) {
 	writeLineArray(&chunk->lines, line, opCount);
 }
 
-int getLine(Chunk* chunk, int offset) {
-	LineArray* lines = &chunk->lines;
-	const int totalLines = lines->count;
+// Drops everything from offset on, for the compiler to take back code it
+// has just emitted.
+void truncateChunk(Chunk* chunk, int offset) {
+	int removed = chunk->count - offset;
+	chunk->count = offset;
 
-	if (totalLines > 0) {
-		int lineOffset = 0;
-		int index = 0;
+	LineArray* lines = &chunk->lines;
+	while (removed > 0 && lines->count > 0) {
+		LineInfo* last = &lines->lines[lines->count - 1];
+		int count = removed < last->opCount ? removed : last->opCount;
+		last->opCount -= count;
+		removed -= count;
+		if (last->opCount == 0) lines->count--;
+	}
+}
 
-		while ((index < totalLines) && (lineOffset < offset)) {
-			lineOffset += lines->lines[index].opCount;
-			if (lineOffset <= offset)
-				index++;
-		}
+// Returns the line of the instruction byte at offset, or -1 if there's
+// no line info for it.
+int getLine(Chunk* chunk, int offset) {
+	LineArray* lines = &chunk->lines;
+	int lineOffset = 0;
 
-		if (lineOffset == offset) {
+	for (int index = 0; index < lines->count; index++) {
+		lineOffset += lines->lines[index].opCount;
+		if (offset < lineOffset) {
 			return lines->lines[index].lineNo;
 		}
 	}
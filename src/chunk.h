@@ -20,6 +20,7 @@ typedef enum {
 	OP_SET_GLOBAL,
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
+	OP_GET_CAPTURED,
 	OP_GET_PROPERTY,
 	OP_SET_PROPERTY,
 	OP_GET_SUPER,
@@ -41,12 +42,16 @@ typedef enum {
 	OP_INVOKE,
 	OP_SUPER_INVOKE,
 	OP_CLOSURE,
+	OP_CLOSURE_LOCAL,
+	OP_REGION_BEGIN,
+	OP_REGION_END,
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
 	OP_BUILD_LIST,
+	OP_FORMAT,
 	OP_INDEX_SUBSCR,
 	OP_STORE_SUBSCR,
 	OP_SLICE_SUBSCR,
@@ -79,6 +84,7 @@ void writeChunk(Chunk*, uint8_t, int);
 void writeConstant(Chunk*, OpCode, int, int);
 int addConstant(Chunk*, Value);
 void addLine(Chunk*, int, int);
+void truncateChunk(Chunk*, int);
 int getLine(Chunk*, int);
 
 #endif // vlox_chunk_h
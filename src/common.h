@@ -12,6 +12,7 @@
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_VERIFY_HEAP
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
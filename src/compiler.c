@@ -47,6 +47,10 @@ typedef struct {
 	int depth;
 	bool isCaptured;
 	bool isMutable;
+	// For local functions, where their OP_CLOSURE is, and whether the
+	// closure is ever used as anything but a callee.
+	int closure;
+	bool escapes;
 } Local;
 
 typedef struct {
@@ -77,6 +81,7 @@ typedef struct LoopContext {
 	LoopJump* jumps;
 	int start;
 	int depth;
+	int regionDepth;
 } LoopContext;
 
 typedef struct Compiler {
@@ -87,8 +92,12 @@ typedef struct Compiler {
 	Local locals[UINT8_COUNT];
 	int localCount;
 	Upvalue upvalues[UINT8_COUNT];
+	Upvalue captures[UINT8_COUNT];
 	int scopeDepth;
+	int regionDepth;
 	LoopContext* currentLoop;
+	int lastGetProperty;
+	int lastJumpTarget;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -193,6 +202,13 @@ static int emitJump(uint8_t instruction) {
 	return currentChunk()->count - 2;
 }
 
+// Jumping out of region blocks has to end them on the way.
+static void emitRegionExits(int depth) {
+	for (int i = current->regionDepth; i > depth; i--) {
+		emitByte(OP_REGION_END);
+	}
+}
+
 static void emitReturn() {
 	if (current->type == TYPE_INITIALIZER) {
 		emitBytes(OP_GET_LOCAL, 0);
@@ -226,6 +242,7 @@ static void patchJump(int offset) {
 
 	currentChunk()->code[offset] = (jump >> 8) & 0xff;
 	currentChunk()->code[offset + 1] = jump & 0xff;
+	current->lastJumpTarget = currentChunk()->count;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
@@ -234,6 +251,10 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
+	compiler->regionDepth = 0;
+	compiler->currentLoop = NULL;
+	compiler->lastGetProperty = -1;
+	compiler->lastJumpTarget = 0;
 	compiler->function = newFunction();
 	current = compiler;
 	if (type != TYPE_SCRIPT) {
@@ -245,6 +266,8 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 	local->depth = 0;
 	local->isCaptured = false;
 	local->isMutable = false;
+	local->closure = -1;
+	local->escapes = false;
 	if (type != TYPE_FUNCTION) {
 		local->name.start = "this";
 		local->name.length = 4;
@@ -255,14 +278,25 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 	}
 }
 
+// A closure that is only ever called can be recycled once its variable is
+// out of scope.
+static void lowerLocalClosure(Local* local) {
+	if (local->closure != -1 && !local->escapes) {
+		currentChunk()->code[local->closure] = OP_CLOSURE_LOCAL;
+	}
+}
+
 static ObjFunction* endCompiler() {
 	emitReturn();
 	ObjFunction* function = current->function;
+	for (int i = 0; i < current->localCount; i++) {
+		lowerLocalClosure(&current->locals[i]);
+	}
 
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError) {
 		disassembleChunk(currentChunk(),
-				function->name != NULL ? function->name->chars : "code");
+				function->name != NULL ? stringChars(function->name) : "code");
 	}
 #endif
 
@@ -278,6 +312,7 @@ static void endScope() {
 	current->scopeDepth--;
 
 	while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
+		lowerLocalClosure(&current->locals[current->localCount - 1]);
 		if (current->locals[current->localCount - 1].isCaptured) {
 			emitByte(OP_CLOSE_UPVALUE);
 		}
@@ -339,17 +374,42 @@ static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
 	return compiler->function->upvalueCount++;
 }
 
+static int addCapture(Compiler* compiler, int index, bool isLocal) {
+	int captureCount = compiler->function->captureCount;
+
+	for (int i = 0; i < captureCount; i++) {
+		Upvalue* capture = &compiler->captures[i];
+		if (capture->index == index && capture->isLocal == isLocal) {
+			return i;
+		}
+	}
+
+	if (captureCount == UINT8_COUNT) {
+		error("Too many closure variables in function.");
+		return 0;
+	}
+
+	compiler->captures[captureCount].isLocal = isLocal;
+	compiler->captures[captureCount].index = index;
+	return compiler->function->captureCount++;
+}
+
+// Immutable variables are captured by value, and their index is into the
+// closure's captures rather than its upvalues.
 static int resolveUpvalue(Compiler* compiler, Token* name, bool* isMutable) {
 	if (compiler->enclosing == NULL) return -1;
 
 	int local = resolveLocal(compiler->enclosing, name, isMutable);
 	if (local != -1) {
+		compiler->enclosing->locals[local].escapes = true;
+		if (!*isMutable) return addCapture(compiler, local, true);
 		compiler->enclosing->locals[local].isCaptured = true;
 		return addUpvalue(compiler, local, true);
 	}
 
 	int upvalue = resolveUpvalue(compiler->enclosing, name, isMutable);
 	if (upvalue != -1) {
+		if (!*isMutable) return addCapture(compiler, upvalue, false);
 		return addUpvalue(compiler, upvalue, false);
 	}
 
@@ -367,6 +427,8 @@ static void addLocal(Token name, bool isMutable) {
 	local->depth = -1;
 	local->isCaptured = false;
 	local->isMutable = isMutable;
+	local->closure = -1;
+	local->escapes = false;
 }
 
 static void declareVariable(bool isMutable) {
@@ -457,6 +519,19 @@ static void binary(bool) {
 }
 
 static void call(bool) {
+	// `(object.method)(...)` is the same as `object.method(...)`, and
+	// needn't bind the method first.
+	int property = current->lastGetProperty;
+	if (property != -1 && property + 2 == currentChunk()->count &&
+			current->lastJumpTarget <= property) {
+		uint8_t name = currentChunk()->code[property + 1];
+		truncateChunk(currentChunk(), property);
+		uint8_t argCount = argumentList();
+		emitBytes(OP_INVOKE, name);
+		emitByte(argCount);
+		return;
+	}
+
 	uint8_t argCount = argumentList();
 	emitBytes(OP_CALL, argCount);
 }
@@ -475,6 +550,7 @@ static void dot(bool canAssign) {
 		emitByte(argCount);
 	}
 	else {
+		current->lastGetProperty = currentChunk()->count;
 		emitBytes(OP_GET_PROPERTY, name);
 	}
 }
@@ -529,6 +605,36 @@ static void string(bool) {
 					parser.previous.length - 2)));
 }
 
+// Emits a piece of an interpolated string, unless it's empty. The
+// delimiters are one character at the start and `end` at the end.
+static int interpolationPiece(int end) {
+	int length = parser.previous.length - 1 - end;
+	if (length == 0) return 0;
+
+	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, length)));
+	return 1;
+}
+
+// All the pieces and values go on the stack, and OP_FORMAT puts them
+// together in one go.
+static void interpolation(bool) {
+	int partCount = 0;
+
+	do {
+		partCount += interpolationPiece(2);
+		expression();
+		partCount++;
+	} while (match(TOKEN_INTERPOLATION));
+
+	if (!match(TOKEN_STRING)) {
+		errorAtCurrent("Expect end of string interpolation.");
+		return;
+	}
+	partCount += interpolationPiece(1);
+
+	emitConstantBytes(OP_FORMAT, partCount);
+}
+
 static void namedVariable(Token name, bool canAssign) {
 	uint8_t getOp, setOp;
 	char nameChars[name.length + 1];
@@ -540,9 +646,10 @@ static void namedVariable(Token name, bool canAssign) {
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
+		if (!check(TOKEN_LEFT_PAREN)) current->locals[arg].escapes = true;
 	}
 	else if ((arg = resolveUpvalue(current, &name, &isMutable)) != -1) {
-		getOp = OP_GET_UPVALUE;
+		getOp = isMutable ? OP_GET_UPVALUE : OP_GET_CAPTURED;
 		setOp = OP_SET_UPVALUE;
 	}
 	else {
@@ -593,6 +700,10 @@ static void super_(bool) {
 		emitBytes(OP_SUPER_INVOKE, name);
 		emitByte(argCount);
 	}
+	else {
+		namedVariable(syntheticToken("super"), false);
+		emitBytes(OP_GET_SUPER, name);
+	}
 }
 
 static void this_(bool) {
@@ -725,6 +836,7 @@ static ParseRule rules[] = {
 	[TOKEN_LESS_EQUAL]	= {NULL,	binary,		PREC_COMPARISON},
 	[TOKEN_IDENTIFIER]	= {variable,	NULL,		PREC_NONE},
 	[TOKEN_STRING]		= {string,	NULL,		PREC_NONE},
+	[TOKEN_INTERPOLATION]	= {interpolation, NULL,		PREC_NONE},
 	[TOKEN_INTEGER]		= {integer,	NULL,		PREC_NONE},
 	[TOKEN_NUMBER]		= {number,	NULL,		PREC_NONE},
 	[TOKEN_AND]		= {NULL,	and_,		PREC_AND},
@@ -738,6 +850,7 @@ static ParseRule rules[] = {
 	[TOKEN_OR]		= {NULL,	or_,		PREC_OR},
 	[TOKEN_PRINT]		= {NULL,	NULL,		PREC_NONE},
 	[TOKEN_QUESTION_MARK]	= {NULL,	ternary,	PREC_TERNARY},
+	[TOKEN_REGION]		= {NULL,	NULL,		PREC_NONE},
 	[TOKEN_RETURN]		= {NULL,	NULL,		PREC_NONE},
 	[TOKEN_SWITCH]		= {NULL,	NULL,		PREC_NONE},
 	[TOKEN_SUPER]		= {super_,	NULL,		PREC_NONE},
@@ -815,6 +928,10 @@ static void function(FunctionType type) {
 		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
 		emitByte(compiler.upvalues[i].index);
 	}
+	for (int i = 0; i < function->captureCount; i++) {
+		emitByte(compiler.captures[i].isLocal ? 1 : 0);
+		emitByte(compiler.captures[i].index);
+	}
 }
 
 static void method() {
@@ -878,7 +995,12 @@ static void classDeclaration() {
 static void funDeclaration() {
 	int global = parseVariable("Expect function name.", true);
 	markInitialized();
+	// The body goes to its own chunk, so this is where OP_CLOSURE lands.
+	int closure = currentChunk()->count;
 	function(TYPE_FUNCTION);
+	if (current->scopeDepth > 0) {
+		current->locals[current->localCount - 1].closure = closure;
+	}
 	defineVariable(global, true);
 }
 
@@ -913,6 +1035,7 @@ static void emitLoopJump(LoopJumpType type) {
 			emitByte(OP_POP);
 		}
 	}
+	emitRegionExits(context->regionDepth);
 
 	if (type == BREAK) {
 		LoopJump* jump = ALLOCATE(LoopJump, 1);
@@ -974,6 +1097,7 @@ static void beginLoop(int loopStart) {
 	context->jumps = NULL;
 	context->start = loopStart;
 	context->depth = current->scopeDepth;
+	context->regionDepth = current->regionDepth;
 	current->currentLoop = context;
 }
 
@@ -1073,6 +1197,7 @@ void returnStatement() {
 	}
 
 	if (match(TOKEN_SEMICOLON)) {
+		emitRegionExits(0);
 		emitReturn();
 	}
 	else {
@@ -1082,6 +1207,7 @@ void returnStatement() {
 
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+		emitRegionExits(0);
 		emitByte(OP_RETURN);
 	}
 }
@@ -1127,6 +1253,7 @@ static void switchStatement() {
 			if (inDefault) {
 				error("Duplicate 'default'.");
 			}
+			inDefault = true;
 			consume(TOKEN_COLON, "Expected ':' after 'default'.");
 			if (nCases > 0) {
 				int jumpHere = cases[nCases - 1];
@@ -1144,13 +1271,19 @@ static void switchStatement() {
 	}
 
 	if (nCases > 0) {
-		for (int i = 0; i < nCases; i++) {
-			patchJump(cases[i]);
-		}
+		// Without a default, the last case's test still jumps here with
+		// its result on the stack.
 		if (!inDefault) {
+			int jumpHere = cases[nCases - 1];
+			cases[nCases - 1] = emitJump(OP_JUMP);
+			patchJump(jumpHere);
 			emitByte(OP_POP);
 		}
+		for (int i = 0; i < nCases; i++) {
+			patchJump(cases[i]);
+		}
 	}
+	// Every way out leaves just the switch value.
 	emitByte(OP_POP);
 }
 
@@ -1171,6 +1304,17 @@ void whileStatement() {
 	endLoop();
 }
 
+static void regionStatement() {
+	consume(TOKEN_LEFT_BRACE, "Expect '{' after 'region'.");
+	emitByte(OP_REGION_BEGIN);
+	current->regionDepth++;
+	beginScope();
+	block();
+	endScope();
+	current->regionDepth--;
+	emitByte(OP_REGION_END);
+}
+
 void synchronize() {
 	parser.panicMode = false;
 
@@ -1184,6 +1328,7 @@ void synchronize() {
 			case TOKEN_IF:
 			case TOKEN_WHILE:
 			case TOKEN_PRINT:
+			case TOKEN_REGION:
 			case TOKEN_RETURN:
 			case TOKEN_SWITCH:
 				return;
@@ -1221,6 +1366,9 @@ void statement() {
 	else if (match(TOKEN_SWITCH)) {
 		switchStatement();
 	}
+	else if (match(TOKEN_REGION)) {
+		regionStatement();
+	}
 	else if (match(TOKEN_RETURN)) {
 		returnStatement();
 	}
@@ -1282,3 +1430,32 @@ void markCompilerRoots() {
 		compiler = compiler->enclosing;
 	}
 }
+
+// Called when an allocation fails halfway through compiling. The
+// compilers live on the C stack, which is about to be unwound.
+void abandonCompilation() {
+	for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+		while (compiler->currentLoop != NULL) {
+			LoopContext* context = compiler->currentLoop;
+			LoopJump* jump = context->jumps;
+			while (jump != NULL) {
+				LoopJump* next = jump->next;
+				FREE(LoopJump, jump);
+				jump = next;
+			}
+			compiler->currentLoop = context->outer;
+			FREE(LoopContext, context);
+		}
+	}
+
+	current = NULL;
+	currentClass = NULL;
+}
+
+void forwardCompilerRoots() {
+	Compiler* compiler = current;
+	while (compiler != NULL) {
+		compiler->function = (ObjFunction*)forwardObject((Obj*)compiler->function);
+		compiler = compiler->enclosing;
+	}
+}
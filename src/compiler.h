@@ -6,5 +6,7 @@
 
 ObjFunction* compile(const char*);
 void markCompilerRoots();
+void forwardCompilerRoots();
+void abandonCompilation();
 
 #endif // vlox_compiler_h
@@ -74,7 +74,7 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 int disassembleInstruction(Chunk* chunk, int offset) {
 	printf("%04d ", offset);
 	int line = getLine(chunk, offset);
-	if (line < 0) {
+	if (line < 0 || (offset > 0 && line == getLine(chunk, offset - 1))) {
 		printf("   | ");
 	}
 	else {
@@ -110,6 +110,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return byteInstruction("OP_GET_UPVALUE", chunk, offset);
 		case OP_SET_UPVALUE:
 			return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+		case OP_GET_CAPTURED:
+			return byteInstruction("OP_GET_CAPTURED", chunk, offset);
 		case OP_GET_PROPERTY:
 			return constantInstruction("OP_GET_PROPERTY", chunk, offset);
 		case OP_SET_PROPERTY:
@@ -148,12 +150,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 			return invokeInstruction("OP_INVOKE", chunk, offset);
 		case OP_SUPER_INVOKE:
 			return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-		case OP_CLOSURE: {
+		case OP_CLOSURE:
+		case OP_CLOSURE_LOCAL: {
 			uint32_t constant;
 
 			offset = decodeConstantIndex(chunk, offset, &constant, NULL);
 
-			printf("%-17s %18d '", "OP_CLOSURE", constant);
+			printf("%-17s %18d '",
+					instruction == OP_CLOSURE ? "OP_CLOSURE" : "OP_CLOSURE_LOCAL",
+					constant);
 			printValue(chunk->constants.values[constant]);
 			printf("'\n");
 
@@ -164,8 +169,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 				printf("%04d    | %40s %d\n",
 						offset - 2, isLocal ? "local" : "upvalue", index);
 			}
+			for (int j = 0; j < function->captureCount; j++) {
+				int isLocal = chunk->code[offset++];
+				int index = chunk->code[offset++];
+				printf("%04d    | %40s %d\n",
+						offset - 2, isLocal ? "local value" : "captured", index);
+			}
 			return offset;
 		}
+		case OP_REGION_BEGIN:
+			return simpleInstruction("OP_REGION_BEGIN", offset);
+		case OP_REGION_END:
+			return simpleInstruction("OP_REGION_END", offset);
 		case OP_CLOSE_UPVALUE:
 			return simpleInstruction("OP_CLOSE_UPVALUE", offset);
 		case OP_RETURN:
@@ -203,6 +218,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
 			return offset;
 		}
+		case OP_FORMAT: {
+			uint32_t index;
+
+			offset = decodeConstantIndex(chunk, offset, NULL, &index);
+
+			printf("%-17s %18d*\n", "OP_FORMAT", index);
+
+			return offset;
+		}
 		case OP_INDEX_SUBSCR:
 			return simpleInstruction("OP_INDEX_SUBSCR", offset);
 		case OP_SLICE_SUBSCR:
@@ -0,0 +1,170 @@
+#include <string.h>
+
+#include "gc.h"
+#include "memory.h"
+#include "metrics.h"
+#include "object.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define RET_ERROR(...) \
+	{\
+		vmRuntimeError(__VA_ARGS__);\
+		NativeReturn result = { INTERPRET_RUNTIME_ERROR, NIL_VAL };\
+		return result;\
+	}
+
+#define RET_OK(val) \
+	{\
+		NativeReturn result = { INTERPRET_OK, val }; \
+		return result; \
+	}
+
+static NativeReturn gc(int, Value*);
+static NativeReturn gcStats(int, Value*);
+static NativeReturn setPolicy(int, Value*);
+static NativeReturn objectStats(int, Value*);
+static NativeReturn writeGcMetrics(int, Value*);
+static NativeReturn writeProfile(int, Value*);
+static NativeReturn writeSnapshot(int, Value*);
+
+static NativeDef nativeFunctions[] = {
+	{ "gc", 0, gc },
+	{ "gcStats", 0, gcStats },
+	{ "setGcPolicy", 1, setPolicy },
+	{ "objectStats", 1, objectStats },
+	{ "writeGcMetrics", 1, writeGcMetrics },
+	{ "writeHeapProfile", 1, writeProfile },
+	{ "writeHeapSnapshot", 1, writeSnapshot },
+	{ NULL, -1, NULL }
+};
+
+void gcNativeFunctions(RegisterNative addToRegistry) {
+	NativeDef* current = &nativeFunctions[0];
+
+	while (current->name != NULL) {
+		addToRegistry(current++);
+	}
+}
+
+NativeReturn gc(int argCount, Value* args) {
+	collectGarbage();
+
+	RET_OK(NIL_VAL);
+}
+
+// The instance is expected on top of the stack, out of the GC's reach.
+static void setStat(const char* name, Value value) {
+	ObjInstance* stats = AS_INSTANCE(vm.stackTop[-1]);
+
+	push(value);
+	push(OBJ_VAL(copyString(name, (int)strlen(name))));
+	tableSet(&stats->fields, AS_STRING(vm.stackTop[-1]), vm.stackTop[-2]);
+	pop();
+	pop();
+}
+
+// Leaves an empty instance of a made-up class on top of the stack.
+static void pushStats(const char* className) {
+	push(OBJ_VAL(copyString(className, (int)strlen(className))));
+	ObjClass* klass = newClass(AS_STRING(vm.stackTop[-1]));
+	push(OBJ_VAL(klass));
+	ObjInstance* stats = newInstance(klass);
+	pop();
+	pop();
+	push(OBJ_VAL(stats));
+}
+
+NativeReturn gcStats(int argCount, Value* args) {
+	PauseStats pauses = pauseStats();
+
+	pushStats("GcStats");
+
+	setStat("collections", INT_VAL((int64_t)vm.collections));
+	setStat("bytesAllocated", INT_VAL((int64_t)vm.bytesAllocated));
+	setStat("nextGC", INT_VAL((int64_t)vm.nextGC));
+	setStat("growthFactor", NUMBER_VAL(vm.heapGrowthFactor));
+	setStat("minHeap", INT_VAL((int64_t)vm.minHeap));
+	setStat("maxHeap", INT_VAL((int64_t)vm.maxHeap));
+	setStat("policy", OBJ_VAL(copyString(vm.gcPolicy, (int)strlen(vm.gcPolicy))));
+	setStat("pauses", INT_VAL((int64_t)pauses.count));
+	setStat("pauseTotal", NUMBER_VAL(pauses.total));
+	setStat("pauseLongest", NUMBER_VAL(pauses.longest));
+	setStat("liveObjects", INT_VAL((int64_t)liveObjects()));
+	setStat("internedStrings", INT_VAL(vm.strings.count));
+	setStat("trims", INT_VAL((int64_t)vm.trims));
+	setStat("promotedBytes", INT_VAL((int64_t)vm.promotedBytes));
+
+	RET_OK(pop());
+}
+
+NativeReturn setPolicy(int argCount, Value* args) {
+	if (!IS_STRING(args[0])) {
+		RET_ERROR("Expected a policy name.");
+	}
+	if (!setGcPolicy(AS_CSTRING(args[0]))) {
+		RET_ERROR("Unknown GC policy '%s'.", AS_CSTRING(args[0]));
+	}
+	vm.nextGC = nextGCThreshold();
+
+	RET_OK(NIL_VAL);
+}
+
+NativeReturn objectStats(int argCount, Value* args) {
+	ObjType type;
+
+	if (!IS_STRING(args[0])) {
+		RET_ERROR("Expected an object type name.");
+	}
+	if (!objTypeFromName(AS_CSTRING(args[0]), &type)) {
+		RET_ERROR("Unknown object type '%s'.", AS_CSTRING(args[0]));
+	}
+
+	TypeStats stats = typeStats(type);
+	pushStats("ObjectStats");
+	setStat("allocated", INT_VAL((int64_t)stats.allocated));
+	setStat("freed", INT_VAL((int64_t)stats.freed));
+	setStat("live", INT_VAL((int64_t)(stats.allocated - stats.freed)));
+	setStat("bytesAllocated", INT_VAL((int64_t)stats.bytesAllocated));
+	setStat("bytesFreed", INT_VAL((int64_t)stats.bytesFreed));
+
+	RET_OK(pop());
+}
+
+NativeReturn writeGcMetrics(int argCount, Value* args) {
+	if (!IS_STRING(args[0])) {
+		RET_ERROR("Expected a file name.");
+	}
+	if (!writeMetrics(AS_CSTRING(args[0]))) {
+		RET_ERROR("Could not write metrics to \"%s\".", AS_CSTRING(args[0]));
+	}
+
+	RET_OK(NIL_VAL);
+}
+
+NativeReturn writeProfile(int argCount, Value* args) {
+	if (!IS_STRING(args[0])) {
+		RET_ERROR("Expected a file name.");
+	}
+	if (vm.heapProfileRate == 0) {
+		RET_ERROR("The heap profiler is off.");
+	}
+	collectGarbage();
+	if (!writeHeapProfile(AS_CSTRING(args[0]))) {
+		RET_ERROR("Could not write heap profile to \"%s\".", AS_CSTRING(args[0]));
+	}
+
+	RET_OK(NIL_VAL);
+}
+
+NativeReturn writeSnapshot(int argCount, Value* args) {
+	if (!IS_STRING(args[0])) {
+		RET_ERROR("Expected a file name.");
+	}
+	if (!writeHeapSnapshot(AS_CSTRING(args[0]))) {
+		RET_ERROR("Could not write heap snapshot to \"%s\".", AS_CSTRING(args[0]));
+	}
+
+	RET_OK(NIL_VAL);
+}
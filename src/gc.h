@@ -0,0 +1,8 @@
+#ifndef vlox_gc_h
+#define vlox_gc_h
+
+#include "native.h"
+
+void gcNativeFunctions(RegisterNative);
+
+#endif // vlox_gc_h
@@ -0,0 +1,105 @@
+/*
+ * Interning throughput, for short keys like identifiers and long ones
+ * like file contents. Build with `make internbench` and run
+ * ../bin/internbench.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "object.h"
+#include "vm.h"
+
+#define SHORT_KEYS 1000000
+#define LONG_KEYS 2000
+#define LONG_KEY_LENGTH 16384
+#define HASH_ROUNDS 20
+
+// What hashString() used to be, for comparison.
+static uint32_t fnv1a(const char* key, int length) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static void fillRandom(char* buffer, size_t length) {
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	for (size_t i = 0; i < length; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buffer[i] = 'a' + state % 26;
+	}
+}
+
+// Interns every key, then looks every one of them up again.
+static void benchIntern(const char* label, const char* keys, int count, int length) {
+	double start = pauseClock();
+	for (int i = 0; i < count; i++) {
+		copyString(keys + (size_t)i * length, length);
+	}
+	double inserted = pauseClock();
+	for (int i = 0; i < count; i++) {
+		copyString(keys + (size_t)i * length, length);
+	}
+	double found = pauseClock();
+
+	printf("%-22s insert %8.2f Mkeys/s %8.1f MB/s   lookup %8.2f Mkeys/s %8.1f MB/s\n",
+			label,
+			count / (inserted - start) / 1e6,
+			(double)count * length / (inserted - start) / 1e6,
+			count / (found - inserted) / 1e6,
+			(double)count * length / (found - inserted) / 1e6);
+}
+
+static void benchHash(const char* label, uint32_t (*hash)(const char*, int),
+		const char* keys, int count, int length) {
+	uint32_t sink = 0;
+	double start = pauseClock();
+	for (int round = 0; round < HASH_ROUNDS; round++) {
+		for (int i = 0; i < count; i++) {
+			sink += hash(keys + (size_t)i * length, length);
+		}
+	}
+	double elapsed = pauseClock() - start;
+
+	printf("%-22s hash   %8.1f MB/s (%08x)\n", label,
+			(double)HASH_ROUNDS * count * length / elapsed / 1e6, sink);
+}
+
+int main(int argc, const char* argv[]) {
+	initVM();
+	// Keep the collector out of it. Nothing here is garbage anyway.
+	vm.nextGC = SIZE_MAX;
+
+	int shortLength = 12;
+	char* shortKeys = malloc((size_t)SHORT_KEYS * shortLength);
+	char* longKeys = malloc((size_t)LONG_KEYS * LONG_KEY_LENGTH);
+	if (shortKeys == NULL || longKeys == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+	for (int i = 0; i < SHORT_KEYS; i++) {
+		char key[32];
+		snprintf(key, sizeof(key), "key_%08d", i);
+		memcpy(shortKeys + (size_t)i * shortLength, key, shortLength);
+	}
+	fillRandom(longKeys, (size_t)LONG_KEYS * LONG_KEY_LENGTH);
+
+	benchHash("short (12 bytes) fnv1a", fnv1a, shortKeys, SHORT_KEYS, shortLength);
+	benchHash("short (12 bytes)", hashString, shortKeys, SHORT_KEYS, shortLength);
+	benchHash("long (16K) fnv1a", fnv1a, longKeys, LONG_KEYS, LONG_KEY_LENGTH);
+	benchHash("long (16K)", hashString, longKeys, LONG_KEYS, LONG_KEY_LENGTH);
+	benchIntern("short (12 bytes)", shortKeys, SHORT_KEYS, shortLength);
+	benchIntern("long (16K)", longKeys, LONG_KEYS, LONG_KEY_LENGTH);
+
+	free(shortKeys);
+	free(longKeys);
+	freeVM();
+	return 0;
+}
@@ -1,15 +1,23 @@
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "metrics.h"
+#include "output.h"
+#include "profiler.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl() {
 	char line[1024];
 
 	for (;;) {
+		flushOutput();
 		printf("> ");
 
 		if (!fgets(line, sizeof(line), stdin)) {
@@ -47,27 +55,244 @@ static char* readFile(const char* path) {
 	return buffer;
 }
 
+static void dumpMetrics() {
+	if (vm.metricsPath != NULL && !writeMetrics(vm.metricsPath)) {
+		fprintf(stderr, "Could not write metrics to \"%s\".\n", vm.metricsPath);
+	}
+	if (vm.heapProfilePath == NULL) return;
+
+	// Only count what's really live.
+	collectGarbage();
+	if (!writeHeapProfile(vm.heapProfilePath)) {
+		fprintf(stderr, "Could not write heap profile to \"%s\".\n", vm.heapProfilePath);
+	}
+}
+
 static void runFile(const char* path) {
 	char* source = readFile(path);
 	InterpretResult result = interpret(source);
 	free(source);
+	flushOutput();
+	dumpMetrics();
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Anything bigger wouldn't fit the 48-bit integers gcStats() reports
+// sizes as.
+#define SIZE_LIMIT (((size_t)1 << 47) - 1)
+
+// Accepts a byte count with an optional K, M or G suffix, up to
+// SIZE_LIMIT.
+static bool parseSize(const char* text, size_t* size) {
+	// strtoull() would take "-1", and wrap it around.
+	if (!isdigit((unsigned char)*text)) return false;
+
+	char* end;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if (errno == ERANGE) return false;
+
+	size_t unit = 1;
+	switch (*end) {
+		case 'G': case 'g': unit *= 1024; // Fall through.
+		case 'M': case 'm': unit *= 1024; // Fall through.
+		case 'K': case 'k': unit *= 1024; end++;
+		default: break;
+	}
+	if (*end != '\0' || value > SIZE_LIMIT / unit) return false;
+	*size = (size_t)value * unit;
+	return true;
+}
+
+// Accepts a whole number from 1 to max.
+static bool parseCount(const char* text, int max, int* count) {
+	if (!isdigit((unsigned char)*text)) return false;
+
+	char* end;
+	errno = 0;
+	long value = strtol(text, &end, 10);
+	if (errno == ERANGE || *end != '\0' || value < 1 || value > max) return false;
+	*count = (int)value;
+	return true;
+}
+
+static bool parseGrowth(const char* text, double* growth) {
+	char* end;
+	*growth = strtod(text, &end);
+	return end != text && *end == '\0' && *growth > 1;
+}
+
+// Accepts a number of seconds or "off".
+static bool parseInterval(const char* text, double* interval) {
+	if (strcmp(text, "off") == 0) {
+		*interval = -1;
+		return true;
+	}
+
+	char* end;
+	*interval = strtod(text, &end);
+	return end != text && *end == '\0' && *interval >= 0;
+}
+
+static bool configureFromEnv() {
+	const char* value;
+
+	if ((value = getenv("VLOX_GC_POLICY")) != NULL && !setGcPolicy(value)) {
+		return false;
+	}
+	if ((value = getenv("VLOX_GC_INITIAL_HEAP")) != NULL) {
+		size_t size;
+		if (!parseSize(value, &size)) return false;
+		vm.nextGC = size;
+	}
+	if ((value = getenv("VLOX_GC_GROWTH")) != NULL) {
+		if (!parseGrowth(value, &vm.heapGrowthFactor)) return false;
+		vm.heapGrowthFactorGiven = true;
+	}
+	if ((value = getenv("VLOX_GC_MIN_HEAP")) != NULL) {
+		if (!parseSize(value, &vm.minHeap)) return false;
+		vm.minHeapGiven = true;
+	}
+	if ((value = getenv("VLOX_GC_MAX_HEAP")) != NULL &&
+			!parseSize(value, &vm.maxHeap)) {
+		return false;
+	}
+	if ((value = getenv("VLOX_GC_TRIM")) != NULL &&
+			!parseInterval(value, &vm.trimInterval)) {
+		return false;
+	}
+	vm.metricsPath = getenv("VLOX_GC_METRICS");
+	vm.heapProfilePath = getenv("VLOX_HEAP_PROFILE");
+	vm.heapSnapshotPath = getenv("VLOX_HEAP_SNAPSHOT");
+	if ((value = getenv("VLOX_HEAP_PROFILE_RATE")) != NULL &&
+			(!parseSize(value, &vm.heapProfileRate) || vm.heapProfileRate == 0)) {
+		return false;
+	}
+	if ((value = getenv("VLOX_OUTPUT_BUFFERING")) != NULL && !setOutputBuffering(value)) {
+		return false;
+	}
+	return true;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: clox [options] [path]\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --gc-sweep-thread       free unreachable objects on a background thread\n");
+	fprintf(stderr, "  --gc-mark-threads=<n>   mark the heap using <n> threads (64 at most)\n");
+	fprintf(stderr, "  --gc-concurrent         mark the heap while the program runs\n");
+	fprintf(stderr, "  --gc-compact=<ratio>    compact the heap when this fraction of it is free holes\n");
+	fprintf(stderr, "  --gc-policy=<name>      balanced (default), throughput or footprint\n");
+	fprintf(stderr, "  --gc-initial-heap=<size> collect for the first time at <size> bytes\n");
+	fprintf(stderr, "  --gc-growth=<factor>    grow the heap by <factor> after each collection\n");
+	fprintf(stderr, "  --gc-min-heap=<size>    never collect below <size> bytes\n");
+	fprintf(stderr, "  --gc-max-heap=<size>    a runtime error when the heap would outgrow <size>\n");
+	fprintf(stderr, "  --gc-trim=<seconds>     return free memory to the OS at most this often (1), or off\n");
+	fprintf(stderr, "  --gc-metrics=<file>     write GC metrics to <file> at exit and on SIGUSR1\n");
+	fprintf(stderr, "  --heap-profile=<file>   write live bytes by allocation site to <file> at exit\n");
+	fprintf(stderr, "  --heap-profile-rate=<size> sample one allocation every <size> bytes (512K)\n");
+	fprintf(stderr, "  --heap-snapshot=<file>  write a heap snapshot to <file> on SIGUSR2\n");
+	fprintf(stderr, "  --output-buffering=<mode> flush print output every line, or every 64K (block)\n");
+	fprintf(stderr, "sizes take an optional K, M or G suffix. The VLOX_GC_POLICY,\n");
+	fprintf(stderr, "VLOX_GC_INITIAL_HEAP, VLOX_GC_GROWTH, VLOX_GC_MIN_HEAP,\n");
+	fprintf(stderr, "VLOX_GC_MAX_HEAP, VLOX_GC_TRIM, VLOX_GC_METRICS, VLOX_HEAP_PROFILE,\n");
+	fprintf(stderr, "VLOX_HEAP_PROFILE_RATE, VLOX_HEAP_SNAPSHOT and VLOX_OUTPUT_BUFFERING\n");
+	fprintf(stderr, "environment variables are read first.\n");
+	exit(64);
+}
+
 int main(int argc, const char* argv[]) {
+	const char* path = NULL;
+
 	initVM();
 
-	if (argc == 1) {
-		repl();
+	if (!configureFromEnv()) {
+		fprintf(stderr, "Invalid VLOX_* setting in the environment.\n");
+		usage();
 	}
-	else if (argc == 2) {
-		runFile(argv[1]);
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--gc-sweep-thread") == 0) {
+			vm.sweepInBackground = true;
+		}
+		else if (strncmp(argv[i], "--gc-mark-threads=", 18) == 0) {
+			if (!parseCount(argv[i] + 18, MARK_THREADS_MAX, &vm.markThreads)) usage();
+		}
+		else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+			vm.markConcurrently = true;
+		}
+		else if (strncmp(argv[i], "--gc-compact=", 13) == 0) {
+			vm.compactionThreshold = atof(argv[i] + 13);
+			if (vm.compactionThreshold <= 0 || vm.compactionThreshold >= 1) usage();
+		}
+		else if (strncmp(argv[i], "--gc-policy=", 12) == 0) {
+			if (!setGcPolicy(argv[i] + 12)) usage();
+		}
+		else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0) {
+			size_t size;
+			if (!parseSize(argv[i] + 18, &size)) usage();
+			vm.nextGC = size;
+		}
+		else if (strncmp(argv[i], "--gc-growth=", 12) == 0) {
+			if (!parseGrowth(argv[i] + 12, &vm.heapGrowthFactor)) usage();
+			vm.heapGrowthFactorGiven = true;
+		}
+		else if (strncmp(argv[i], "--gc-min-heap=", 14) == 0) {
+			if (!parseSize(argv[i] + 14, &vm.minHeap)) usage();
+			vm.minHeapGiven = true;
+		}
+		else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0) {
+			if (!parseSize(argv[i] + 14, &vm.maxHeap)) usage();
+		}
+		else if (strncmp(argv[i], "--gc-trim=", 10) == 0) {
+			if (!parseInterval(argv[i] + 10, &vm.trimInterval)) usage();
+		}
+		else if (strncmp(argv[i], "--gc-metrics=", 13) == 0) {
+			vm.metricsPath = argv[i] + 13;
+		}
+		else if (strncmp(argv[i], "--heap-profile=", 15) == 0) {
+			vm.heapProfilePath = argv[i] + 15;
+		}
+		else if (strncmp(argv[i], "--heap-profile-rate=", 20) == 0) {
+			if (!parseSize(argv[i] + 20, &vm.heapProfileRate) || vm.heapProfileRate == 0) usage();
+		}
+		else if (strncmp(argv[i], "--heap-snapshot=", 16) == 0) {
+			vm.heapSnapshotPath = argv[i] + 16;
+		}
+		else if (strncmp(argv[i], "--output-buffering=", 19) == 0) {
+			if (!setOutputBuffering(argv[i] + 19)) usage();
+		}
+		else if (argv[i][0] == '-' || path != NULL) {
+			usage();
+		}
+		else {
+			path = argv[i];
+		}
+	}
+
+	// A policy's minimum just gives way to the maximum.
+	if (vm.minHeapGiven && vm.maxHeap > 0 && vm.minHeap > vm.maxHeap) {
+		fprintf(stderr, "The minimum heap size can't be above the maximum.\n");
+		usage();
+	}
+
+	if (vm.metricsPath != NULL) {
+		watchMetricsSignal();
+	}
+	if (vm.heapSnapshotPath != NULL) {
+		watchSnapshotSignal();
+	}
+	if (vm.heapProfilePath != NULL && vm.heapProfileRate == 0) {
+		vm.heapProfileRate = 512 * 1024;
+	}
+
+	if (path == NULL) {
+		repl();
+		dumpMetrics();
 	}
 	else {
-		fprintf(stderr, "usage: clox [path]\n");
-		exit(64);
+		runFile(path);
 	}
 
 	freeVM();
@@ -1,36 +1,557 @@
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "compiler.h"
 #include "memory.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#define HAVE_MALLOC_TRIM
+#if __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33
+#define HAVE_MALLINFO2
+#endif
+#endif
+
+typedef struct {
+	const char* name;
+	double growthFactor;
+	size_t minHeap;
+} GcPolicy;
+
+static const GcPolicy policies[] = {
+	{ "balanced", 2, 1024 * 1024 },
+	// Collect rarely, at the cost of a bigger heap.
+	{ "throughput", 4, 16 * 1024 * 1024 },
+	// Keep the heap close to the live data.
+	{ "footprint", 1.25, 256 * 1024 },
+	{ NULL, 0, 0 }
+};
+
+// Knobs set explicitly win over the policy, whichever came first.
+bool setGcPolicy(const char* name) {
+	for (const GcPolicy* policy = &policies[0]; policy->name != NULL; policy++) {
+		if (strcmp(policy->name, name) == 0) {
+			vm.gcPolicy = policy->name;
+			if (!vm.heapGrowthFactorGiven) vm.heapGrowthFactor = policy->growthFactor;
+			if (!vm.minHeapGiven) vm.minHeap = policy->minHeap;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Where the next collection should happen, given what's allocated now.
+ *
+ * The heap grows by vm.heapGrowthFactor, but never sets the bar below
+ * vm.minHeap, nor above vm.maxHeap (when there's one). Going past that
+ * is an error anyway.
+ */
+size_t nextGCThreshold() {
+	size_t next = (size_t)(vm.bytesAllocated * vm.heapGrowthFactor);
+
+	if (next < vm.minHeap) next = vm.minHeap;
+	if (vm.maxHeap > 0 && next > vm.maxHeap) next = vm.maxHeap;
+	return next;
+}
+
+/*
+ * Background sweeping.
+ *
+ * When vm.sweepInBackground is set, sweep() only unlinks the unreached
+ * objects and hands them over to a dedicated thread, which does the actual
+ * freeing. The mutator never sees those objects again, so the only shared
+ * state is the pending list (protected by the lock) and the allocation
+ * counters, which are atomic.
+ */
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t drained;
+	Obj* pending;
+	bool busy;
+	bool started;
+	bool shutdown;
+} Sweeper;
+
+static Sweeper sweeper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.drained = PTHREAD_COND_INITIALIZER,
+	.pending = NULL,
+	.busy = false,
+	.started = false,
+	.shutdown = false
+};
+
+/*
+ * Parallel marking.
+ *
+ * With vm.markThreads > 1, traceReferences() spreads the gray objects
+ * over a pool of markers (the main thread being one of them). Each marker
+ * works off a private stack and publishes part of it on a shared one when
+ * it grows large, so that idle markers have something to steal. Marking an
+ * object is an atomic test-and-set on its mark bit, so every object gets
+ * blackened exactly once no matter who reaches it first.
+ */
+#define MARK_PUBLISH_THRESHOLD 64
+
+typedef struct {
+	int count;
+	int capacity;
+	Obj** objects;
+} ObjStack;
+
+typedef struct {
+	pthread_t thread;
+	ObjStack local;
+	pthread_mutex_t lock;
+	ObjStack shared;
+} Marker;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t finished;
+	Marker* markers;
+	int count;
+	int generation;
+	int done;
+	atomic_int idle;
+	bool shutdown;
+} MarkerPool;
+
+static MarkerPool pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.finished = PTHREAD_COND_INITIALIZER,
+	.markers = NULL,
+	.count = 0,
+	.generation = 0,
+	.done = 0,
+	.shutdown = false
+};
+
+static _Thread_local Marker* currentMarker = NULL;
+
+/*
+ * Concurrent marking.
+ *
+ * With vm.markConcurrently set, crossing vm.nextGC asks for a cycle to
+ * start at the next safepoint. The roots are grayed in a short pause, and
+ * a background marker traces the rest while run() keeps going.
+ *
+ * This is a snapshot-at-the-beginning collector: before the mutator
+ * changes an object that may predate the cycle, writeBarrier() makes sure
+ * that object has been scanned, so that everything it referenced when the
+ * cycle started gets marked. Objects allocated meanwhile are born black.
+ * The globals table gets the same treatment. Once the marker runs dry,
+ * the next allocation does a final pause that re-marks the roots, drains
+ * what's left and sweeps.
+ */
+typedef struct {
+	pthread_t thread;
+	pthread_cond_t wakeup;
+	Marker marker;
+	atomic_bool idle;
+	atomic_bool stop;
+	bool running;
+} ConcurrentMarker;
+
+static ConcurrentMarker concurrent = {
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.marker = { .lock = PTHREAD_MUTEX_INITIALIZER },
+	.running = false
+};
+
+// Collects whatever the mutator grays while scanning in a write barrier.
+static Marker mutatorMarker = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static atomic_uchar globalsScanState = SCAN_PENDING;
+
+// Slices whose parent was left unmarked on purpose. See ObjStringSlice.
+static _Atomic(ObjStringSlice*) weakSlices = NULL;
+// Functions whose local closure wasn't marked through them. See ObjFunction.
+static _Atomic(ObjFunction*) weakFunctions = NULL;
+
+/*
+ * Regions.
+ *
+ * Inside region { ... }, objects are bump-allocated from big blocks
+ * instead of getting a malloc() each, and they're kept on their own list,
+ * so collections trace them when reachable but never sweep them. When the
+ * outermost region ends, whatever is still reachable is copied out to the
+ * ordinary heap, much like compaction does, and the blocks are released
+ * in one go, taking everything else with them.
+ *
+ * Finding what escaped doesn't need the whole heap traced: only the roots
+ * and the outside objects changed since the region began can point into
+ * it, and writeBarrier() remembers the latter.
+ */
+#define REGION_BLOCK_SIZE (64 * 1024)
+#define REGION_ALIGNMENT _Alignof(max_align_t)
+
+typedef struct RegionBlock {
+	struct RegionBlock* next;
+	size_t capacity;
+	size_t used;
+	max_align_t data[];
+} RegionBlock;
+
+static struct {
+	RegionBlock* blocks;
+	// Kept around for the next region, so that a loop of them doesn't
+	// call malloc() every time.
+	RegionBlock* spare;
+	ObjStack remembered;
+	bool globalsRemembered;
+	// The region's objects, while it ends.
+	ObjStack objects;
+	// Only follow references into the region, or forward them.
+	bool marking;
+	bool forwarding;
+} region = {
+	.blocks = NULL,
+	.spare = NULL,
+	.globalsRemembered = false,
+	.marking = false,
+	.forwarding = false
+};
+
+static void freeObject(Obj*);
+static size_t objectSize(Obj*);
+static void waitForSweeper();
+static void releaseSpareBlock();
+
+static void triggerCollection() {
+	if (!vm.markConcurrently || vm.isMarking || vm.regionDepth > 0) {
+		// When marking concurrently, we're out of headroom. Finish now.
+		collectGarbage();
+	}
+	else if (vm.bytesAllocated > vm.nextGC * vm.heapGrowthFactor) {
+		// It's been too long without reaching a safepoint.
+		collectGarbage();
+	}
+	else {
+		// A concurrent cycle can only start where no C code is halfway
+		// through changing an object.
+		vm.safepointRequested = true;
+	}
+}
+
+#ifdef DEBUG_VERIFY_HEAP
+/*
+ * Heap verifier.
+ *
+ * Every block that goes through reallocate() is logged in a side table
+ * along with its size, and the object type if it is one. Giving back a
+ * block with a size other than the one it was allocated with, or one that
+ * was never handed out, aborts on the spot. So does any difference between
+ * the table's total and vm.bytesAllocated, which is checked after each
+ * collection and at exit. Whatever is still in the table when freeVM()
+ * is done has leaked.
+ */
+#define UNTYPED -1
+
+typedef struct {
+	void* pointer;
+	size_t size;
+	int type;
+} Allocation;
+
+#define LOG_TOMBSTONE ((void*)1)
+
+static struct {
+	pthread_mutex_t lock;
+	Allocation* entries;
+	int count; // Tombstones included.
+	int capacity;
+	size_t total;
+	// Already counted in vm.bytesAllocated by a reallocate() that
+	// collected before getting to the table.
+	size_t inFlight;
+} heapLog = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static Allocation* findAllocation(Allocation* entries, int capacity, void* pointer) {
+	uintptr_t bits = (uintptr_t)pointer >> 4;
+	uint32_t index = (uint32_t)(bits ^ (bits >> 32)) * 2654435761u & (capacity - 1);
+	Allocation* tombstone = NULL;
+
+	for (;;) {
+		Allocation* entry = &entries[index];
+		if (entry->pointer == NULL) {
+			return tombstone != NULL ? tombstone : entry;
+		}
+		else if (entry->pointer == LOG_TOMBSTONE) {
+			if (tombstone == NULL) tombstone = entry;
+		}
+		else if (entry->pointer == pointer) {
+			return entry;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void growHeapLog() {
+	int capacity = GROW_CAPACITY(heapLog.capacity) * 8;
+	Allocation* entries = (Allocation*)calloc(capacity, sizeof(Allocation));
+	if (entries == NULL) exit(1);
+
+	heapLog.count = 0;
+	for (int i = 0; i < heapLog.capacity; i++) {
+		Allocation* entry = &heapLog.entries[i];
+		if (entry->pointer == NULL || entry->pointer == LOG_TOMBSTONE) continue;
+
+		*findAllocation(entries, capacity, entry->pointer) = *entry;
+		heapLog.count++;
+	}
+
+	free(heapLog.entries);
+	heapLog.entries = entries;
+	heapLog.capacity = capacity;
+}
+
+static void heapLogInsert(void* pointer, size_t size, int type) {
+	if (heapLog.count + 1 > heapLog.capacity * 3 / 4) growHeapLog();
+
+	Allocation* entry = findAllocation(heapLog.entries, heapLog.capacity, pointer);
+	if (entry->pointer == NULL) heapLog.count++;
+	entry->pointer = pointer;
+	entry->size = size;
+	entry->type = type;
+	heapLog.total += size;
+}
+
+static Allocation heapLogRemove(void* pointer, size_t size) {
+	Allocation* entry = heapLog.capacity == 0 ? NULL
+		: findAllocation(heapLog.entries, heapLog.capacity, pointer);
+
+	if (entry == NULL || entry->pointer != pointer) {
+		fprintf(stderr, "heap verifier: %p (%zu bytes) was never allocated\n", pointer, size);
+		abort();
+	}
+	if (entry->size != size) {
+		fprintf(stderr, "heap verifier: %p allocated with %zu bytes, given back as %zu\n",
+				pointer, entry->size, size);
+		abort();
+	}
+
+	Allocation removed = *entry;
+	entry->pointer = LOG_TOMBSTONE;
+	heapLog.total -= size;
+	return removed;
+}
+
+// Returns the type the block was tagged with, to carry it over.
+static int verifyRelease(void* pointer, size_t size) {
+	if (pointer == NULL) return UNTYPED;
+
+	pthread_mutex_lock(&heapLog.lock);
+	int type = heapLogRemove(pointer, size).type;
+	pthread_mutex_unlock(&heapLog.lock);
+	return type;
+}
+
+static void verifyAcquire(void* pointer, size_t size, int type) {
+	pthread_mutex_lock(&heapLog.lock);
+	heapLogInsert(pointer, size, type);
+	pthread_mutex_unlock(&heapLog.lock);
+}
+
+void verifyObjectType(Obj* object) {
+	pthread_mutex_lock(&heapLog.lock);
+	findAllocation(heapLog.entries, heapLog.capacity, object)->type = object->type;
+	pthread_mutex_unlock(&heapLog.lock);
+}
+
+static void verifyMove(Obj* from, Obj* to) {
+	pthread_mutex_lock(&heapLog.lock);
+	Allocation moved = heapLogRemove(from, objectSize(from));
+	heapLogInsert(to, moved.size, moved.type);
+	pthread_mutex_unlock(&heapLog.lock);
+}
+
+// Only meaningful while no other thread is allocating or freeing.
+static void verifyAccounting() {
+	if (heapLog.total + heapLog.inFlight != vm.bytesAllocated) {
+		fprintf(stderr, "heap verifier: vm.bytesAllocated is %zu, but %zu bytes are in use\n",
+				(size_t)vm.bytesAllocated, heapLog.total + heapLog.inFlight);
+		abort();
+	}
+}
+
+void verifyHeapAtExit() {
+	size_t objects[OBJ_TYPE_COUNT] = { 0 };
+	size_t bytes[OBJ_TYPE_COUNT] = { 0 };
+	size_t otherBlocks = 0;
+	size_t otherBytes = 0;
+
+	for (int i = 0; i < heapLog.capacity; i++) {
+		Allocation* entry = &heapLog.entries[i];
+		if (entry->pointer == NULL || entry->pointer == LOG_TOMBSTONE) continue;
+
+		if (entry->type == UNTYPED) {
+			otherBlocks++;
+			otherBytes += entry->size;
+		}
+		else {
+			objects[entry->type]++;
+			bytes[entry->type] += entry->size;
+		}
+	}
+
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+		if (objects[i] > 0) {
+			fprintf(stderr, "heap verifier: leaked %zu %s objects (%zu bytes)\n",
+					objects[i], objTypeName((ObjType)i), bytes[i]);
+		}
+	}
+	if (otherBlocks > 0) {
+		fprintf(stderr, "heap verifier: leaked %zu other blocks (%zu bytes)\n",
+				otherBlocks, otherBytes);
+	}
+
+	verifyAccounting();
+	free(heapLog.entries);
+}
+#endif
+
+/*
+ * Gives up on an allocation that would take the heap past vm.maxHeap,
+ * or that malloc() couldn't satisfy. Inside interpret() this is an
+ * ordinary runtime error: the stack is reset and interpret() returns
+ * INTERPRET_RUNTIME_ERROR, so the host can carry on. Whatever the
+ * abandoned C code had allocated so far stays around until collected.
+ */
+static void outOfMemory(size_t oldSize, size_t newSize) {
+	vm.bytesAllocated -= newSize - oldSize;
+#ifdef DEBUG_VERIFY_HEAP
+	heapLog.inFlight = 0;
+#endif
+
+	if (vm.outOfMemory == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	abandonCompilation();
+	if (vm.maxHeap > 0 && vm.bytesAllocated + newSize - oldSize > vm.maxHeap) {
+		vmRuntimeError("Out of memory: the heap can't grow past %zu bytes.", vm.maxHeap);
+	}
+	else {
+		vmRuntimeError("Out of memory.");
+	}
+	longjmp(*vm.outOfMemory, 1);
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 	vm.bytesAllocated += newSize - oldSize;
 	if (newSize > oldSize) {
+#ifdef DEBUG_VERIFY_HEAP
+		heapLog.inFlight = newSize - oldSize;
+#endif
 #ifdef DEBUG_STRESS_GC
 		collectGarbage();
 #endif
 		if (vm.bytesAllocated > vm.nextGC) {
+			triggerCollection();
+		}
+		else if (vm.isMarking && atomic_load(&concurrent.idle)) {
+			collectGarbage();
+		}
+
+		if (vm.maxHeap > 0 && vm.bytesAllocated > vm.maxHeap) {
+			// Last chance. Make sure the garbage is really gone.
 			collectGarbage();
+			waitForSweeper();
+			if (vm.bytesAllocated > vm.maxHeap) outOfMemory(oldSize, newSize);
 		}
+#ifdef DEBUG_VERIFY_HEAP
+		heapLog.inFlight = 0;
+#endif
 	}
 
+#ifdef DEBUG_VERIFY_HEAP
+	int type = verifyRelease(pointer, oldSize);
+#endif
+
 	if (newSize == 0) {
 		free(pointer);
 		return NULL;
 	}
 
 	void* result = realloc(pointer, newSize);
-	if (result == NULL) exit(1);
+	if (result == NULL) {
+#ifdef DEBUG_VERIFY_HEAP
+		if (pointer != NULL) verifyAcquire(pointer, oldSize, type);
+#endif
+		outOfMemory(oldSize, newSize);
+	}
+#ifdef DEBUG_VERIFY_HEAP
+	verifyAcquire(result, newSize, type);
+#endif
 	return result;
 }
 
+static void pushObject(ObjStack* stack, Obj* object) {
+	if (stack->capacity < stack->count + 1) {
+		stack->capacity = GROW_CAPACITY(stack->capacity);
+		stack->objects = (Obj**)realloc(stack->objects, sizeof(Obj*) * stack->capacity);
+		if (stack->objects == NULL) exit(1);
+	}
+
+	stack->objects[stack->count++] = object;
+}
+
+static void publishWork(Marker* marker) {
+	ObjStack* local = &marker->local;
+	int keep = local->count / 2;
+
+	pthread_mutex_lock(&marker->lock);
+	for (int i = keep; i < local->count; i++) {
+		pushObject(&marker->shared, local->objects[i]);
+	}
+	pthread_mutex_unlock(&marker->lock);
+	local->count = keep;
+}
+
+static void pushGray(Obj* object) {
+	if (vm.grayCapacity < vm.grayCount + 1) {
+		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+		vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+		if (vm.grayStack == NULL) exit(1);
+	}
+
+	vm.grayStack[vm.grayCount++] = object;
+}
+
 void markObject(Obj* object) {
 	if (object == NULL) return;
+	if (region.marking && object->region != REGION_INSIDE) return;
+
+	if (currentMarker != NULL) {
+		if (atomic_load_explicit(&object->isMarked, memory_order_relaxed)) return;
+		if (atomic_exchange_explicit(&object->isMarked, true, memory_order_relaxed)) return;
+
+		pushObject(&currentMarker->local, object);
+		if (currentMarker->local.count > MARK_PUBLISH_THRESHOLD) {
+			publishWork(currentMarker);
+		}
+		return;
+	}
+
 	if (object->isMarked) return;
 
 #ifdef DEBUG_LOG_GC
@@ -39,14 +560,7 @@ void markObject(Obj* object) {
 	printf("\n");
 #endif
 	object->isMarked = true;
-
-	if (vm.grayCapacity < vm.grayCount + 1) {
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-		if (vm.grayStack == NULL) exit(1);
-	}
-
-	vm.grayStack[vm.grayCount++] = object;
+	pushGray(object);
 }
 
 void markValue(Value value) {
@@ -84,12 +598,28 @@ static void blackenObject(Obj* object) {
 			for (int i = 0; i < closure->upvalueCount; i++) {
 				markObject((Obj*)closure->upvalues[i]);
 			}
+			for (int i = 0; i < closure->captureCount; i++) {
+				markValue(closureCaptures(closure)[i]);
+			}
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			markObject((Obj*)function->name);
+			markObject((Obj*)function->sharedClosure);
 			markArray(&function->chunk.constants);
+			if (function->localClosure == NULL) break;
+
+			// Ending a region can't clear it afterwards.
+			if (region.marking) {
+				markObject((Obj*)function->localClosure);
+				break;
+			}
+
+			ObjFunction* head = atomic_load(&weakFunctions);
+			do {
+				function->nextWeak = head;
+			} while (!atomic_compare_exchange_weak(&weakFunctions, &head, function));
 			break;
 		}
 		case OBJ_INSTANCE: {
@@ -103,147 +633,1261 @@ static void blackenObject(Obj* object) {
 			markArray(&list->items);
 			break;
 		}
+		case OBJ_STRING_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			markObject((Obj*)rope->left);
+			markObject((Obj*)rope->right);
+			break;
+		}
+		case OBJ_STRING_SLICE: {
+			ObjStringSlice* slice = (ObjStringSlice*)object;
+			if (slice->parent == NULL) break;
+
+			// Ending a region can't copy anything, so it keeps parents.
+			if (region.marking
+					|| slice->parent->length <= SLICE_COMPACT_RATIO * slice->string.length) {
+				markObject((Obj*)slice->parent);
+				break;
+			}
+
+			ObjStringSlice* head = atomic_load(&weakSlices);
+			do {
+				slice->nextWeak = head;
+			} while (!atomic_compare_exchange_weak(&weakSlices, &head, slice));
+			break;
+		}
 		case OBJ_UPVALUE:
 			markValue(((ObjUpvalue*)object)->closed);
 			break;
 		case OBJ_NATIVE:
 		case OBJ_STRING:
 		case OBJ_STRING_DYNAMIC:
+		case OBJ_STRING_BUILDER:
 			break;
 	}
 }
 
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-	printf("%p free type %d\n", (void*)object, object->type);
-#endif
+// Moves up to half of the victim's shared work to the thief's local stack.
+static bool stealWork(Marker* thief, Marker* victim) {
+	bool stolen = false;
 
-	switch (object->type) {
-		case OBJ_BOUND_METHOD:
-			FREE(ObjBoundMethod, object);
-			break;
-		case OBJ_CLASS: {
-			ObjClass* klass = (ObjClass*)object;
-			klass->initializer = NULL;
-			freeTable(&klass->methods);
-			FREE(ObjClass, object);
-			break;
-		}
-		case OBJ_CLOSURE: {
-			ObjClosure* closure = (ObjClosure*)object;
-			FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-			FREE(ObjClosure, object);
-			break;
-		}
-		case OBJ_FUNCTION: {
-			ObjFunction* function = (ObjFunction*)object;
-			freeChunk(&function->chunk);
-			FREE(ObjFunction, object);
-			break;
-		}
-		case OBJ_INSTANCE: {
-			ObjInstance* instance = (ObjInstance*)object;
-			freeTable(&instance->fields);
-			FREE(ObjInstance, instance);
-			break;
-		}
-		case OBJ_LIST: {
-			ObjList* list = (ObjList*)object;
-			freeValueArray(&list->items);
-			break;
-		}
-		case OBJ_NATIVE:
-			FREE(ObjNative, object);
-			break;
-		case OBJ_STRING:
-			FREE(ObjString, object);
-			break;
-		case OBJ_STRING_DYNAMIC: {
-			ObjString* string = (ObjString*) object;
-			FREE_VARIABLE(ObjStringDynamic, string->length + 1, object);
-			break;
-		}
-		case OBJ_UPVALUE:
-			FREE(ObjUpvalue, object);
-			break;
+	pthread_mutex_lock(&victim->lock);
+	int take = (victim->shared.count + 1) / 2;
+	for (int i = 0; i < take; i++) {
+		pushObject(&thief->local, victim->shared.objects[--victim->shared.count]);
+		stolen = true;
 	}
+	pthread_mutex_unlock(&victim->lock);
+
+	return stolen;
 }
 
-void freeObjects() {
-	Obj* object = vm.objects;
+static bool findWork(Marker* marker) {
+	if (stealWork(marker, marker)) return true;
 
-	while (object != NULL) {
-		Obj* next = object->next;
-		freeObject(object);
-		object = next;
+	int self = (int)(marker - pool.markers);
+	for (int i = 1; i < pool.count; i++) {
+		if (stealWork(marker, &pool.markers[(self + i) % pool.count])) return true;
 	}
 
-	free(vm.grayStack);
+	return false;
 }
 
-static void markRoots() {
-	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-		markValue(*slot);
+static bool anyWorkLeft() {
+	for (int i = 0; i < pool.count; i++) {
+		Marker* marker = &pool.markers[i];
+		pthread_mutex_lock(&marker->lock);
+		int count = marker->shared.count;
+		pthread_mutex_unlock(&marker->lock);
+		if (count > 0) return true;
 	}
 
-	for (int i = 0; i < vm.frameCount; i++) {
-		markObject((Obj*)vm.frames[i].closure);
+	return false;
+}
+
+static void drainMarker(Marker* marker) {
+	currentMarker = marker;
+
+	for (;;) {
+		while (marker->local.count > 0) {
+			blackenObject(marker->local.objects[--marker->local.count]);
+		}
+
+		if (findWork(marker)) continue;
+
+		// Out of work. We're done when everybody else is, too; until then,
+		// somebody may still publish something for us to steal.
+		atomic_fetch_add(&pool.idle, 1);
+		for (;;) {
+			if (atomic_load(&pool.idle) == pool.count) {
+				currentMarker = NULL;
+				return;
+			}
+			if (anyWorkLeft()) {
+				atomic_fetch_sub(&pool.idle, 1);
+				break;
+			}
+			sched_yield();
+		}
 	}
+}
 
-	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-		markObject((Obj*)upvalue);
+static void* markerMain(void* arg) {
+	Marker* marker = (Marker*)arg;
+	int generation = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == generation && !pool.shutdown) {
+			pthread_cond_wait(&pool.wakeup, &pool.lock);
+		}
+		if (pool.shutdown) break;
+		generation = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		drainMarker(marker);
+
+		pthread_mutex_lock(&pool.lock);
+		pool.done++;
+		pthread_cond_signal(&pool.finished);
 	}
+	pthread_mutex_unlock(&pool.lock);
 
-	markTable(&vm.globals);
-	markCompilerRoots();
-	markObject((Obj*)vm.initString);
+	return NULL;
 }
 
-static void traceReferences() {
-	while (vm.grayCount > 0) {
-		Obj* object = vm.grayStack[--vm.grayCount];
-		blackenObject(object);
+static void stopMarkers() {
+	if (pool.count == 0) return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = true;
+	pthread_cond_broadcast(&pool.wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+	// Marker 0 is the main thread.
+	for (int i = 1; i < pool.count; i++) {
+		pthread_join(pool.markers[i].thread, NULL);
 	}
+	for (int i = 0; i < pool.count; i++) {
+		free(pool.markers[i].local.objects);
+		free(pool.markers[i].shared.objects);
+		pthread_mutex_destroy(&pool.markers[i].lock);
+	}
+	free(pool.markers);
+
+	pool.markers = NULL;
+	pool.count = 0;
+	pool.generation = 0;
+	pool.shutdown = false;
 }
 
-static void sweep() {
-	Obj* previous = NULL;
-	Obj* object = vm.objects;
-	while (object != NULL) {
-		if (object->isMarked) {
-			object->isMarked = false;
-			previous = object;
-			object = object->next;
-		}
-		else {
-			Obj* unreached = object;
-			object = object->next;
-			if (previous != NULL) {
-				previous->next = object;
-			}
-			else {
-				vm.objects = object;
-			}
+static bool startMarkers(int count) {
+	if (pool.count == count) return true;
+	stopMarkers();
+
+	pool.markers = (Marker*)calloc(count, sizeof(Marker));
+	if (pool.markers == NULL) return false;
 
-			freeObject(unreached);
+	for (int i = 0; i < count; i++) {
+		pthread_mutex_init(&pool.markers[i].lock, NULL);
+	}
+	pool.count = 1;
+	for (int i = 1; i < count; i++) {
+		if (pthread_create(&pool.markers[i].thread, NULL, markerMain, &pool.markers[i]) != 0) {
+			break;
 		}
+		pool.count++;
 	}
+
+	// Settle for what we got, rather than trying again on every collection.
+	vm.markThreads = pool.count;
+	return pool.count > 1;
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
-#endif
+static void traceReferencesInParallel() {
+	// Deal the roots out, so that everybody starts with something.
+	for (int i = 0; i < vm.grayCount; i++) {
+		pushObject(&pool.markers[i % pool.count].shared, vm.grayStack[i]);
+	}
+	vm.grayCount = 0;
 
-#define GC_HEAP_GROWTH_FACTOR 2
+	pthread_mutex_lock(&pool.lock);
+	atomic_store(&pool.idle, 0);
+	pool.done = 0;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wakeup);
+	pthread_mutex_unlock(&pool.lock);
 
-	markRoots();
-	traceReferences();
-	tableRemoveWhite(&vm.strings);
+	drainMarker(&pool.markers[0]);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.done < pool.count - 1) {
+		pthread_cond_wait(&pool.finished, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static bool claimScan(atomic_uchar* state) {
+	unsigned char expected = SCAN_PENDING;
+	return atomic_compare_exchange_strong(state, &expected, SCAN_BUSY);
+}
+
+static void finishScan(atomic_uchar* state) {
+	atomic_store_explicit(state, SCAN_DONE, memory_order_release);
+}
+
+static void waitForScan(atomic_uchar* state) {
+	while (atomic_load_explicit(state, memory_order_acquire) != SCAN_DONE) {
+		sched_yield();
+	}
+}
+
+static void moveWork(ObjStack* from, ObjStack* to) {
+	for (int i = 0; i < from->count; i++) {
+		pushObject(to, from->objects[i]);
+	}
+	from->count = 0;
+}
+
+static void* concurrentMarkerMain(void* arg) {
+	Marker* marker = &concurrent.marker;
+	currentMarker = marker;
+
+	if (claimScan(&globalsScanState)) {
+		markTable(&vm.globals);
+		finishScan(&globalsScanState);
+	}
+
+	for (;;) {
+		while (marker->local.count > 0 && !atomic_load_explicit(&concurrent.stop, memory_order_relaxed)) {
+			Obj* object = marker->local.objects[--marker->local.count];
+			if (claimScan(&object->scanState)) {
+				blackenObject(object);
+				finishScan(&object->scanState);
+			}
+		}
+
+		pthread_mutex_lock(&marker->lock);
+		while (marker->shared.count == 0 && !atomic_load(&concurrent.stop)) {
+			atomic_store(&concurrent.idle, true);
+			pthread_cond_wait(&concurrent.wakeup, &marker->lock);
+		}
+		atomic_store(&concurrent.idle, false);
+		moveWork(&marker->shared, &marker->local);
+		pthread_mutex_unlock(&marker->lock);
+
+		if (atomic_load(&concurrent.stop)) break;
+	}
+
+	currentMarker = NULL;
+	return NULL;
+}
+
+static void handOverToMarker() {
+	Marker* marker = &concurrent.marker;
+
+	if (mutatorMarker.local.count == 0 && mutatorMarker.shared.count == 0) return;
+
+	pthread_mutex_lock(&marker->lock);
+	moveWork(&mutatorMarker.local, &marker->shared);
+	moveWork(&mutatorMarker.shared, &marker->shared);
+	pthread_cond_signal(&concurrent.wakeup);
+	pthread_mutex_unlock(&marker->lock);
+}
+
+void scanBeforeWrite(Obj* object) {
+	if (atomic_load_explicit(&object->scanState, memory_order_acquire) == SCAN_DONE) return;
+
+	if (!claimScan(&object->scanState)) {
+		// The marker got there first. It won't take long.
+		waitForScan(&object->scanState);
+		return;
+	}
+
+	atomic_store_explicit(&object->isMarked, true, memory_order_relaxed);
+	currentMarker = &mutatorMarker;
+	blackenObject(object);
+	currentMarker = NULL;
+	finishScan(&object->scanState);
+
+	handOverToMarker();
+}
+
+void scanGlobalsBeforeWrite() {
+	if (atomic_load_explicit(&globalsScanState, memory_order_acquire) == SCAN_DONE) return;
+
+	if (!claimScan(&globalsScanState)) {
+		waitForScan(&globalsScanState);
+		return;
+	}
+
+	currentMarker = &mutatorMarker;
+	markTable(&vm.globals);
+	currentMarker = NULL;
+	finishScan(&globalsScanState);
+
+	handOverToMarker();
+}
+
+static void stopConcurrentMarker() {
+	Marker* marker = &concurrent.marker;
+
+	if (concurrent.running) {
+		pthread_mutex_lock(&marker->lock);
+		atomic_store(&concurrent.stop, true);
+		pthread_cond_signal(&concurrent.wakeup);
+		pthread_mutex_unlock(&marker->lock);
+
+		pthread_join(concurrent.thread, NULL);
+		concurrent.running = false;
+	}
+
+	// Whatever is left gets done in the final pause.
+	for (int i = 0; i < marker->local.count; i++) pushGray(marker->local.objects[i]);
+	for (int i = 0; i < marker->shared.count; i++) pushGray(marker->shared.objects[i]);
+	marker->local.count = 0;
+	marker->shared.count = 0;
+}
+
+// Frees what the object owns, but not the object itself.
+static void releaseObject(Obj* object) {
+	switch (object->type) {
+		case OBJ_CLASS: {
+			ObjClass* klass = (ObjClass*)object;
+			klass->initializer = NULL;
+			freeTable(&klass->methods);
+			break;
+		}
+		case OBJ_FUNCTION:
+			freeChunk(&((ObjFunction*)object)->chunk);
+			break;
+		case OBJ_INSTANCE:
+			freeTable(&((ObjInstance*)object)->fields);
+			break;
+		case OBJ_LIST: {
+			ObjList* list = (ObjList*)object;
+			if (!isListInline(list)) freeValueArray(&list->items);
+			break;
+		}
+		case OBJ_STRING_ROPE: {
+			ObjString* string = (ObjString*)object;
+			if (isFlat(string)) FREE_ARRAY(char, stringChars(string), string->length + 1);
+			break;
+		}
+		case OBJ_STRING_SLICE: {
+			ObjStringSlice* slice = (ObjStringSlice*)object;
+			if (slice->parent == NULL) FREE_ARRAY(char, slice->chars, slice->string.length + 1);
+			break;
+		}
+		case OBJ_STRING_BUILDER: {
+			ObjStringBuilder* builder = (ObjStringBuilder*)object;
+			FREE_ARRAY(char, builder->chars, builder->capacity);
+			break;
+		}
+		case OBJ_BOUND_METHOD:
+		case OBJ_CLOSURE:
+		case OBJ_NATIVE:
+		case OBJ_STRING:
+		case OBJ_STRING_DYNAMIC:
+		case OBJ_UPVALUE:
+			break;
+	}
+}
+
+static void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+	printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+	size_t size = objectSize(object);
+	recordFree(object->type, size);
+	releaseObject(object);
+	reallocate(object, size, 0);
+}
+
+static void* sweeperMain(void* arg) {
+	pthread_mutex_lock(&sweeper.lock);
+	for (;;) {
+		while (sweeper.pending == NULL && !sweeper.shutdown) {
+			pthread_cond_wait(&sweeper.wakeup, &sweeper.lock);
+		}
+		if (sweeper.pending == NULL) break; // Shutting down, and nothing left to do.
+
+		Obj* object = sweeper.pending;
+		sweeper.pending = NULL;
+		sweeper.busy = true;
+		pthread_mutex_unlock(&sweeper.lock);
+
+		while (object != NULL) {
+			Obj* next = object->next;
+			freeObject(object);
+			object = next;
+		}
+
+		pthread_mutex_lock(&sweeper.lock);
+		if (sweeper.pending == NULL) {
+			// collectGarbage() set the threshold before the garbage was
+			// actually released. Now we know how much is really live.
+			vm.nextGC = nextGCThreshold();
+			sweeper.busy = false;
+			pthread_cond_broadcast(&sweeper.drained);
+		}
+	}
+	pthread_mutex_unlock(&sweeper.lock);
+
+	return NULL;
+}
+
+static bool startSweeper() {
+	if (sweeper.started) return true;
+
+	sweeper.shutdown = false;
+	if (pthread_create(&sweeper.thread, NULL, sweeperMain, NULL) != 0) {
+		return false;
+	}
+	sweeper.started = true;
+	return true;
+}
+
+static void waitForSweeper() {
+	if (!sweeper.started) return;
+
+	pthread_mutex_lock(&sweeper.lock);
+	while (sweeper.pending != NULL || sweeper.busy) {
+		pthread_cond_wait(&sweeper.drained, &sweeper.lock);
+	}
+	pthread_mutex_unlock(&sweeper.lock);
+}
+
+static void stopSweeper() {
+	if (!sweeper.started) return;
+
+	pthread_mutex_lock(&sweeper.lock);
+	sweeper.shutdown = true;
+	pthread_cond_signal(&sweeper.wakeup);
+	pthread_mutex_unlock(&sweeper.lock);
+
+	pthread_join(sweeper.thread, NULL);
+	sweeper.started = false;
+}
+
+static void handOffGarbage(Obj* first, Obj* last) {
+	if (!startSweeper()) {
+		// No thread, no problem. Do it ourselves.
+		vm.sweepInBackground = false;
+		while (first != NULL) {
+			Obj* next = first->next;
+			freeObject(first);
+			first = next;
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&sweeper.lock);
+	last->next = sweeper.pending;
+	sweeper.pending = first;
+	pthread_cond_signal(&sweeper.wakeup);
+	pthread_mutex_unlock(&sweeper.lock);
+}
+
+void freeObjects() {
+	stopConcurrentMarker();
+	stopSweeper();
+	stopMarkers();
+	atomic_store(&weakSlices, NULL);
+	atomic_store(&weakFunctions, NULL);
+
+	Obj* object = vm.objects;
+
+	while (object != NULL) {
+		Obj* next = object->next;
+		freeObject(object);
+		object = next;
+	}
+
+	free(vm.grayStack);
+	free(concurrent.marker.local.objects);
+	free(concurrent.marker.shared.objects);
+	free(mutatorMarker.local.objects);
+	free(mutatorMarker.shared.objects);
+	free(region.remembered.objects);
+	free(region.objects.objects);
+	releaseSpareBlock();
+}
+
+// Everything but the globals, which the marker can scan on its own.
+static void markSnapshotRoots() {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		markValue(*slot);
+	}
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		markObject((Obj*)vm.frames[i].closure);
+	}
+
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+		markObject((Obj*)upvalue);
+	}
+
+	markCompilerRoots();
+	markObject((Obj*)vm.initString);
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		markObject((Obj*)vm.singleChars[i]);
+	}
+}
+
+static void markRoots() {
+	markSnapshotRoots();
+	markTable(&vm.globals);
+}
+
+static void traceReferences() {
+	if (vm.markThreads > 1 && startMarkers(vm.markThreads)) {
+		traceReferencesInParallel();
+		return;
+	}
+
+	while (vm.grayCount > 0) {
+		Obj* object = vm.grayStack[--vm.grayCount];
+		blackenObject(object);
+	}
+}
+
+/*
+ * Gives the slices whose parent is about to be swept a copy of their
+ * characters. Like promoteObject(), this doesn't go through reallocate(),
+ * which could collect.
+ */
+static void detachOrphanedSlices() {
+	ObjStringSlice* slice = atomic_exchange(&weakSlices, NULL);
+
+	while (slice != NULL) {
+		ObjStringSlice* next = slice->nextWeak;
+		slice->nextWeak = NULL;
+
+		// The mutator may have detached it since.
+		if (slice->parent != NULL && !slice->parent->obj.isMarked) {
+			size_t size = slice->string.length + 1;
+			char* chars = (char*)malloc(size);
+			if (chars == NULL) exit(1);
+			memcpy(chars, slice->chars, size - 1);
+			chars[size - 1] = '\0';
+			slice->chars = chars;
+			slice->parent = NULL;
+
+			vm.bytesAllocated += size;
+#ifdef DEBUG_VERIFY_HEAP
+			verifyAcquire(chars, size, UNTYPED);
+#endif
+		}
+		slice = next;
+	}
+}
+
+// Forgets the local closures nothing else kept alive.
+static void clearUnmarkedLocalClosures() {
+	ObjFunction* function = atomic_exchange(&weakFunctions, NULL);
+
+	while (function != NULL) {
+		ObjFunction* next = function->nextWeak;
+		function->nextWeak = NULL;
+
+		if (function->localClosure != NULL && !function->localClosure->obj.isMarked) {
+			function->localClosure = NULL;
+		}
+		function = next;
+	}
+}
+
+static void sweep() {
+	Obj* previous = NULL;
+	Obj* object = vm.objects;
+	Obj* garbage = NULL;
+	Obj* lastGarbage = NULL;
+	while (object != NULL) {
+		if (object->isMarked) {
+			atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
+			atomic_store_explicit(&object->scanState, SCAN_PENDING, memory_order_relaxed);
+			previous = object;
+			object = object->next;
+		}
+		else {
+			Obj* unreached = object;
+			object = object->next;
+			if (previous != NULL) {
+				previous->next = object;
+			}
+			else {
+				vm.objects = object;
+			}
+			if (unreached->isSampled) forgetSample(unreached);
+
+			if (vm.sweepInBackground) {
+				unreached->next = garbage;
+				garbage = unreached;
+				if (lastGarbage == NULL) lastGarbage = unreached;
+			}
+			else {
+				freeObject(unreached);
+			}
+		}
+	}
+
+	if (garbage != NULL) {
+		handOffGarbage(garbage, lastGarbage);
+	}
+
+	// Region objects were traced all the same. They go when it ends.
+	for (object = vm.regionObjects; object != NULL; object = object->next) {
+		atomic_store_explicit(&object->isMarked, false, memory_order_relaxed);
+		atomic_store_explicit(&object->scanState, SCAN_PENDING, memory_order_relaxed);
+	}
+}
+
+/*
+ * Compaction.
+ *
+ * Objects come straight from malloc, so there's no heap of our own to
+ * slide them around in. Instead, compaction evacuates: every object is
+ * copied into a fresh block, which malloc carves out of the holes left by
+ * earlier collections, and then the old blocks are released together, so
+ * they can coalesce. While that happens, the old object's next field
+ * forwards to its copy.
+ *
+ * References from C locals can't be fixed up, so this only runs from
+ * runSafepoint().
+ */
+static size_t objectSize(Obj* object) {
+	switch (object->type) {
+		case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+		case OBJ_CLASS: return sizeof(ObjClass);
+		case OBJ_CLOSURE:
+			return closureSize(((ObjClosure*)object)->upvalueCount,
+					((ObjClosure*)object)->captureCount);
+		case OBJ_FUNCTION: return sizeof(ObjFunction);
+		case OBJ_INSTANCE: return sizeof(ObjInstance);
+		case OBJ_LIST: return sizeof(ObjList);
+		case OBJ_NATIVE: return sizeof(ObjNative);
+		case OBJ_STRING: return sizeof(ObjStringExternal);
+		case OBJ_STRING_DYNAMIC:
+			return sizeof(ObjStringDynamic) + ((ObjString*)object)->length + 1;
+		case OBJ_STRING_ROPE: return sizeof(ObjRope);
+		case OBJ_STRING_SLICE: return sizeof(ObjStringSlice);
+		case OBJ_STRING_BUILDER: return sizeof(ObjStringBuilder);
+		case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	}
+
+	return 0; // Unreachable.
+}
+
+static double heapFragmentation() {
+#ifdef HAVE_MALLINFO2
+	struct mallinfo2 info = mallinfo2();
+	if (info.arena == 0) return 0;
+	// The top chunk is free, but not a hole.
+	return (double)(info.fordblks - info.keepcost) / (double)info.arena;
+#else
+	return 0;
+#endif
+}
+
+Obj* forwardObject(Obj* object) {
+	if (object == NULL) return NULL;
+	// When a region ends, only what was in it moves.
+	if (region.forwarding && object->region != REGION_INSIDE) return object;
+	return object->next;
+}
+
+static Value forwardValue(Value value) {
+	return IS_OBJ(value) ? OBJ_VAL(forwardObject(AS_OBJ(value))) : value;
+}
+
+static void forwardArray(ValueArray* array) {
+	for (int i = 0; i < array->count; i++) {
+		array->values[i] = forwardValue(array->values[i]);
+	}
+}
+
+static void forwardTable(Table* table) {
+	for (int i = 0; i < table->capacity; i++) {
+		Entry* entry = &table->entries[i];
+		entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+		entry->value = forwardValue(entry->value);
+	}
+}
+
+// Fixes up the references held by a copy, which still point to the
+// originals. The original is still around for comparison.
+static void forwardReferences(Obj* copy, Obj* original) {
+	switch (copy->type) {
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)copy;
+			bound->receiver = forwardValue(bound->receiver);
+			bound->method = (ObjClosure*)forwardObject((Obj*)bound->method);
+			break;
+		}
+		case OBJ_CLASS: {
+			ObjClass* klass = (ObjClass*)copy;
+			klass->name = (ObjString*)forwardObject((Obj*)klass->name);
+			klass->initializer = (ObjClosure*)forwardObject((Obj*)klass->initializer);
+			forwardTable(&klass->methods);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)copy;
+			closure->function = (ObjFunction*)forwardObject((Obj*)closure->function);
+			for (int i = 0; i < closure->upvalueCount; i++) {
+				closure->upvalues[i] = (ObjUpvalue*)forwardObject((Obj*)closure->upvalues[i]);
+			}
+			Value* captures = closureCaptures(closure);
+			for (int i = 0; i < closure->captureCount; i++) {
+				captures[i] = forwardValue(captures[i]);
+			}
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*)copy;
+			function->name = (ObjString*)forwardObject((Obj*)function->name);
+			function->sharedClosure = (ObjClosure*)forwardObject((Obj*)function->sharedClosure);
+			function->localClosure = (ObjClosure*)forwardObject((Obj*)function->localClosure);
+			forwardArray(&function->chunk.constants);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)copy;
+			instance->klass = (ObjClass*)forwardObject((Obj*)instance->klass);
+			forwardTable(&instance->fields);
+			break;
+		}
+		case OBJ_LIST: {
+			ObjList* list = (ObjList*)copy;
+			if (isListInline((ObjList*)original)) {
+				list->items.values = list->inlineItems;
+			}
+			forwardArray(&list->items);
+			break;
+		}
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+			if (upvalue->location == &((ObjUpvalue*)original)->closed) {
+				upvalue->location = &upvalue->closed;
+			}
+			upvalue->closed = forwardValue(upvalue->closed);
+			upvalue->next = (ObjUpvalue*)forwardObject((Obj*)upvalue->next);
+			break;
+		}
+		case OBJ_STRING_ROPE: {
+			ObjRope* rope = (ObjRope*)copy;
+			rope->left = (ObjString*)forwardObject((Obj*)rope->left);
+			rope->right = (ObjString*)forwardObject((Obj*)rope->right);
+			break;
+		}
+		case OBJ_STRING_SLICE: {
+			ObjStringSlice* slice = (ObjStringSlice*)copy;
+			if (slice->parent != NULL) {
+				slice->parent = (ObjString*)forwardObject((Obj*)slice->parent);
+				slice->chars = stringChars(slice->parent) + slice->offset;
+			}
+			break;
+		}
+		case OBJ_NATIVE:
+		case OBJ_STRING:
+		case OBJ_STRING_DYNAMIC:
+		case OBJ_STRING_BUILDER:
+			break;
+	}
+}
+
+static void forwardRoots() {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		*slot = forwardValue(*slot);
+	}
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].closure = (ObjClosure*)forwardObject((Obj*)vm.frames[i].closure);
+	}
+
+	vm.openUpvalues = (ObjUpvalue*)forwardObject((Obj*)vm.openUpvalues);
+	forwardTable(&vm.globals);
+	forwardTable(&vm.strings);
+	forwardCompilerRoots();
+	vm.initString = (ObjString*)forwardObject((Obj*)vm.initString);
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		vm.singleChars[i] = (ObjString*)forwardObject((Obj*)vm.singleChars[i]);
+	}
+}
+
+static void compactHeap() {
+	int count = 0;
+	for (Obj* object = vm.objects; object != NULL; object = object->next) {
+		count++;
+	}
+
+	Obj** originals = (Obj**)malloc(sizeof(Obj*) * count);
+	if (originals == NULL) return;
+
+#ifdef DEBUG_LOG_GC
+	printf("-- compaction begin\n");
+#endif
+
+	// The copies are the same size as the originals, so the byte count
+	// doesn't change. Allocating through reallocate() could start a
+	// collection halfway through, so don't.
+	Obj* first = NULL;
+	Obj* last = NULL;
+	Obj* object = vm.objects;
+	for (int i = 0; i < count; i++) {
+		Obj* next = object->next;
+		size_t size = objectSize(object);
+		Obj* copy = (Obj*)malloc(size);
+		if (copy == NULL) exit(1);
+		memcpy(copy, object, size);
+
+		copy->next = NULL;
+		if (last == NULL) {
+			first = copy;
+		}
+		else {
+			last->next = copy;
+		}
+		last = copy;
+
+		object->next = copy;
+		originals[i] = object;
+		object = next;
+	}
+
+	for (int i = 0; i < count; i++) {
+		forwardReferences(originals[i]->next, originals[i]);
+		if (originals[i]->isSampled) moveSample(originals[i], originals[i]->next);
+#ifdef DEBUG_VERIFY_HEAP
+		verifyMove(originals[i], originals[i]->next);
+#endif
+	}
+	forwardRoots();
+	vm.objects = first;
+
+	for (int i = 0; i < count; i++) {
+		free(originals[i]);
+	}
+	free(originals);
+
+#ifdef DEBUG_LOG_GC
+	printf("-- compaction end\n");
+	printf("   moved %d objects\n", count);
+#endif
+}
+
+void* regionAllocate(size_t size) {
+	size = (size + REGION_ALIGNMENT - 1) & ~(REGION_ALIGNMENT - 1);
+
+	RegionBlock* block = region.blocks;
+	if (block != NULL && block->used + size <= block->capacity) {
+		void* result = (char*)block->data + block->used;
+		block->used += size;
+		return result;
+	}
+
+	if (size > REGION_BLOCK_SIZE / 4) {
+		// Big objects get a block of their own, which goes behind the
+		// current one so that it keeps filling up.
+		block = (RegionBlock*)reallocate(NULL, 0, sizeof(RegionBlock) + size);
+		block->capacity = size;
+		if (region.blocks != NULL) {
+			block->next = region.blocks->next;
+			region.blocks->next = block;
+		}
+		else {
+			block->next = NULL;
+			region.blocks = block;
+		}
+	}
+	else {
+		if (region.spare != NULL) {
+			block = region.spare;
+			region.spare = NULL;
+		}
+		else {
+			block = (RegionBlock*)reallocate(NULL, 0, sizeof(RegionBlock) + REGION_BLOCK_SIZE);
+			block->capacity = REGION_BLOCK_SIZE;
+		}
+		block->next = region.blocks;
+		region.blocks = block;
+	}
+
+	block->used = size;
+	return block->data;
+}
+
+static void releaseSpareBlock() {
+	if (region.spare == NULL) return;
+
+	reallocate(region.spare, sizeof(RegionBlock) + REGION_BLOCK_SIZE, 0);
+	region.spare = NULL;
+}
+
+static void releaseRegionBlocks() {
+	RegionBlock* block = region.blocks;
+	while (block != NULL) {
+		RegionBlock* next = block->next;
+		if (block->capacity == REGION_BLOCK_SIZE && region.spare == NULL) {
+			region.spare = block;
+		}
+		else {
+			reallocate(block, sizeof(RegionBlock) + block->capacity, 0);
+		}
+		block = next;
+	}
+	region.blocks = NULL;
+}
+
+void rememberObject(Obj* object) {
+	// Strings don't hold any references.
+	if (object->type == OBJ_STRING || object->type == OBJ_STRING_DYNAMIC) return;
+
+	object->region = REGION_REMEMBERED;
+	pushObject(&region.remembered, object);
+}
+
+void rememberGlobals() {
+	region.globalsRemembered = true;
+}
+
+// The collector is about to free the remembered objects nobody can reach
+// any more. Whatever they pointed to in the region is garbage too.
+static void forgetUnreachedRemembered() {
+	ObjStack* remembered = &region.remembered;
+	int kept = 0;
+	for (int i = 0; i < remembered->count; i++) {
+		if (remembered->objects[i]->isMarked) {
+			remembered->objects[kept++] = remembered->objects[i];
+		}
+	}
+	remembered->count = kept;
+}
+
+void enterRegion() {
+	if (vm.regionDepth++ > 0) return;
+
+	// The concurrent marker can't be looking at objects that may move
+	// when the region ends. Finish the cycle, and don't start another.
+	if (vm.isMarking) collectGarbage();
+}
+
+// Marks the region objects that can still be reached.
+static void markEscapes() {
+	ObjStack* remembered = &region.remembered;
+
+	region.marking = true;
+	markSnapshotRoots();
+	if (region.globalsRemembered) markTable(&vm.globals);
+	for (int i = 0; i < remembered->count; i++) {
+		blackenObject(remembered->objects[i]);
+	}
+	while (vm.grayCount > 0) {
+		blackenObject(vm.grayStack[--vm.grayCount]);
+	}
+	region.marking = false;
+}
+
+// Copies an escaping object to the ordinary heap, leaving a forwarding
+// pointer behind. Like compactHeap(), this doesn't go through
+// reallocate(), which could collect halfway through.
+static void promoteObject(Obj* object) {
+	size_t size = objectSize(object);
+	Obj* copy = (Obj*)malloc(size);
+	if (copy == NULL) exit(1);
+	memcpy(copy, object, size);
+
+	atomic_store_explicit(&copy->isMarked, false, memory_order_relaxed);
+	copy->region = REGION_OUTSIDE;
+	copy->next = vm.objects;
+	vm.objects = copy;
+	object->next = copy;
+
+	vm.bytesAllocated += size;
+	vm.promotedBytes += size;
+#ifdef DEBUG_VERIFY_HEAP
+	verifyAcquire(copy, size, object->type);
+#endif
+}
+
+static void forwardRegionRoots() {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		*slot = forwardValue(*slot);
+	}
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].closure = (ObjClosure*)forwardObject((Obj*)vm.frames[i].closure);
+	}
+
+	// Upvalues for variables declared before the region may have been
+	// opened inside it, between older ones.
+	for (ObjUpvalue** upvalue = &vm.openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->next) {
+		*upvalue = (ObjUpvalue*)forwardObject((Obj*)*upvalue);
+	}
+
+	if (region.globalsRemembered) forwardTable(&vm.globals);
+	for (int i = 0; i < region.remembered.count; i++) {
+		Obj* object = region.remembered.objects[i];
+		forwardReferences(object, object);
+	}
+}
+
+static void endOutermostRegion() {
+	double start = pauseClock();
+
+	// Their next fields are about to be taken over for forwarding.
+	for (Obj* object = vm.regionObjects; object != NULL; object = object->next) {
+		pushObject(&region.objects, object);
+	}
+	vm.regionObjects = NULL;
+	Obj** objects = region.objects.objects;
+	int count = region.objects.count;
+
+	markEscapes();
+	for (int i = 0; i < count; i++) {
+		if (objects[i]->isMarked) promoteObject(objects[i]);
+	}
+
+	region.forwarding = true;
+	for (int i = 0; i < count; i++) {
+		if (objects[i]->isMarked) forwardReferences(objects[i]->next, objects[i]);
+	}
+	forwardRegionRoots();
+	region.forwarding = false;
+
+	for (int i = 0; i < count; i++) {
+		Obj* object = objects[i];
+		bool isInterned = (object->type == OBJ_STRING || object->type == OBJ_STRING_DYNAMIC)
+			&& ((ObjString*)object)->interned;
+
+		if (object->isMarked) {
+			if (isInterned) {
+				tableReplaceKey(&vm.strings, (ObjString*)object, (ObjString*)object->next);
+			}
+			if (object->isSampled) moveSample(object, object->next);
+		}
+		else {
+			// vm.strings is weak.
+			if (isInterned) tableDelete(&vm.strings, (ObjString*)object);
+			if (object->isSampled) forgetSample(object);
+			recordFree(object->type, objectSize(object));
+			releaseObject(object);
+		}
+	}
+	region.objects.count = 0;
+	releaseRegionBlocks();
+
+	for (int i = 0; i < region.remembered.count; i++) {
+		region.remembered.objects[i]->region = REGION_OUTSIDE;
+	}
+	region.remembered.count = 0;
+	region.globalsRemembered = false;
+
+	recordPause(pauseClock() - start);
+}
+
+void exitRegion() {
+	if (vm.regionDepth == 0) return;
+	if (--vm.regionDepth == 0) endOutermostRegion();
+}
+
+void exitAllRegions() {
+	if (vm.regionDepth == 0) return;
+
+	vm.regionDepth = 1;
+	exitRegion();
+}
+
+static void startConcurrentCycle() {
+	Marker* marker = &concurrent.marker;
+	double start = pauseClock();
+
+#ifdef DEBUG_LOG_GC
+	printf("-- concurrent mark begin\n");
+#endif
+
+	vm.isMarking = true;
+	markSnapshotRoots();
+	for (int i = 0; i < vm.grayCount; i++) {
+		pushObject(&marker->shared, vm.grayStack[i]);
+	}
+	vm.grayCount = 0;
+
+	atomic_store(&concurrent.stop, false);
+	atomic_store(&concurrent.idle, false);
+	if (pthread_create(&concurrent.thread, NULL, concurrentMarkerMain, NULL) != 0) {
+		// Do it the old way.
+		collectGarbage();
+		return;
+	}
+	concurrent.running = true;
+
+	// Give the mutator some room to allocate before the marker is done.
+	vm.nextGC = nextGCThreshold();
+	recordPause(pauseClock() - start);
+}
+
+/*
+ * Trimming.
+ *
+ * Freed objects go back to malloc, which keeps the memory for itself, so
+ * after a burst the process stays as big as it ever got. When malloc sits
+ * on more free memory than the heap has live data, the next safepoint
+ * shrinks the VM's own buffers and asks malloc to return its free pages to
+ * the OS. That costs page faults if the program grows again, so it happens
+ * at most once every vm.trimInterval seconds.
+ */
+static struct {
+	bool requested;
+	double last;
+	size_t peak;
+} trim = { .requested = false, .last = 0, .peak = 0 };
+
+static void requestTrim(size_t before) {
+	if (vm.trimInterval < 0) return;
+
+	if (before > trim.peak) trim.peak = before;
+	if (pauseClock() - trim.last < vm.trimInterval) return;
+	trim.requested = true;
+	vm.safepointRequested = true;
+}
+
+static size_t reclaimableBytes() {
+#ifdef HAVE_MALLINFO2
+	return mallinfo2().fordblks;
+#else
+	// Whatever we've given back since the peak is probably still there.
+	return trim.peak > vm.bytesAllocated ? trim.peak - vm.bytesAllocated : 0;
+#endif
+}
+
+static bool sweeperIsBusy() {
+	if (!sweeper.started) return false;
+
+	pthread_mutex_lock(&sweeper.lock);
+	bool busy = sweeper.pending != NULL || sweeper.busy;
+	pthread_mutex_unlock(&sweeper.lock);
+	return busy;
+}
+
+static void releaseObjStack(ObjStack* stack) {
+	if (stack->count > 0) return;
+	free(stack->objects);
+	stack->objects = NULL;
+	stack->capacity = 0;
+}
+
+static void trimHeap() {
+	double start = pauseClock();
+
+	shrinkStack();
+	tableShrink(&vm.strings);
+
+	// Between collections the mark stacks are empty.
+	if (vm.grayCount == 0) {
+		free(vm.grayStack);
+		vm.grayStack = NULL;
+		vm.grayCapacity = 0;
+	}
+	for (int i = 0; i < pool.count; i++) {
+		releaseObjStack(&pool.markers[i].local);
+		releaseObjStack(&pool.markers[i].shared);
+	}
+	releaseObjStack(&concurrent.marker.local);
+	releaseObjStack(&concurrent.marker.shared);
+	releaseObjStack(&mutatorMarker.local);
+	releaseObjStack(&mutatorMarker.shared);
+	releaseObjStack(&region.remembered);
+	releaseObjStack(&region.objects);
+	releaseSpareBlock();
+
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+
+	vm.trims++;
+	trim.last = pauseClock();
+	trim.peak = vm.bytesAllocated;
+	recordPause(trim.last - start);
+}
+
+static void serviceTrimRequest() {
+	// The marker may be using the mark stacks.
+	if (!trim.requested || vm.isMarking) return;
+
+	if (sweeperIsBusy()) {
+		// Come back once the garbage has really been freed.
+		vm.safepointRequested = true;
+		return;
+	}
+
+	trim.requested = false;
+	if (reclaimableBytes() > vm.bytesAllocated) trimHeap();
+}
+
+void runSafepoint() {
+	vm.safepointRequested = false;
+	serviceMetricsRequest();
+	serviceSnapshotRequest();
+
+	// Can't move objects under the concurrent marker's feet, nor while
+	// region objects, which don't get forwarded, point at them.
+	if (vm.compactionRequested && !vm.isMarking && vm.regionDepth == 0) {
+		vm.compactionRequested = false;
+		double start = pauseClock();
+		compactHeap();
+		recordPause(pauseClock() - start);
+	}
+
+	serviceTrimRequest();
+
+	if (vm.markConcurrently && !vm.isMarking && vm.regionDepth == 0
+			&& vm.bytesAllocated > vm.nextGC) {
+		startConcurrentCycle();
+	}
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+#endif
+	size_t before = vm.bytesAllocated;
+	double start = pauseClock();
+
+	if (vm.isMarking) {
+		stopConcurrentMarker();
+	}
+
+	markRoots();
+	traceReferences();
+	tableRemoveWhite(&vm.strings);
+	detachOrphanedSlices();
+	clearUnmarkedLocalClosures();
+	forgetUnreachedRemembered();
 	sweep();
 
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROWTH_FACTOR;
+	vm.collections++;
+	vm.isMarking = false;
+	atomic_store(&globalsScanState, SCAN_PENDING);
+	atomic_store(&concurrent.idle, false);
+
+	if (vm.compactionThreshold > 0 && heapFragmentation() > vm.compactionThreshold) {
+		vm.compactionRequested = true;
+		vm.safepointRequested = true;
+	}
+	requestTrim(before);
+
+	// With a background sweeper this still counts the garbage in flight,
+	// which keeps us from collecting again right away. The sweeper lowers
+	// the threshold once it's done.
+	vm.nextGC = nextGCThreshold();
+	recordPause(pauseClock() - start);
+
+#ifdef DEBUG_VERIFY_HEAP
+	if (!vm.sweepInBackground) verifyAccounting();
+#endif
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
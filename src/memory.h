@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
 	(type*)reallocate(NULL, 0, sizeof(type) * count);
@@ -24,6 +25,38 @@ void* reallocate(void*, size_t, size_t);
 void markObject(Obj*);
 void markValue(Value);
 void collectGarbage();
+bool setGcPolicy(const char*);
+size_t nextGCThreshold();
 void freeObjects();
+void runSafepoint();
+Obj* forwardObject(Obj*);
+void scanBeforeWrite(Obj*);
+void scanGlobalsBeforeWrite();
+void* regionAllocate(size_t);
+void rememberObject(Obj*);
+void rememberGlobals();
+void enterRegion();
+void exitRegion();
+void exitAllRegions();
+
+#ifdef DEBUG_VERIFY_HEAP
+void verifyObjectType(Obj*);
+void verifyHeapAtExit();
+#endif
+
+// Must be called before changing any reference held by an object that
+// may predate the current concurrent mark, or the open region.
+static inline void writeBarrier(Obj* object) {
+	if (vm.isMarking) scanBeforeWrite(object);
+	if (vm.regionDepth > 0 && object->region == REGION_OUTSIDE) rememberObject(object);
+}
+
+// Must be called before storing the value in a global.
+static inline void globalsWriteBarrier(Value value) {
+	if (vm.isMarking) scanGlobalsBeforeWrite();
+	if (vm.regionDepth > 0 && IS_OBJ(value) && AS_OBJ(value)->region == REGION_INSIDE) {
+		rememberGlobals();
+	}
+}
 
 #endif // vlox_memory_h
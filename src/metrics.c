@@ -0,0 +1,218 @@
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "vm.h"
+
+/*
+ * Always-on GC telemetry.
+ *
+ * Counting has to be cheap: a couple of relaxed atomic additions per
+ * allocation and per free. The counters are atomic because the background
+ * sweeper frees objects too. Pauses are only ever timed on the main thread.
+ *
+ * The numbers can be read from Lox through gcStats() and objectStats(),
+ * and written out in Prometheus' text format, at exit or on SIGUSR1, to
+ * the file named by vm.metricsPath.
+ */
+typedef struct {
+	atomic_size_t allocated;
+	atomic_size_t freed;
+	atomic_size_t bytesAllocated;
+	atomic_size_t bytesFreed;
+} TypeCounters;
+
+static TypeCounters typeCounters[OBJ_TYPE_COUNT];
+
+// Upper bounds, in seconds, of the pause histogram buckets.
+static const double pauseBuckets[] = {
+	0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1
+};
+
+#define PAUSE_BUCKET_COUNT (sizeof(pauseBuckets) / sizeof(pauseBuckets[0]))
+
+static struct {
+	size_t buckets[PAUSE_BUCKET_COUNT];
+	PauseStats stats;
+} pauses;
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+	[OBJ_BOUND_METHOD] = "bound_method",
+	[OBJ_CLASS] = "class",
+	[OBJ_CLOSURE] = "closure",
+	[OBJ_FUNCTION] = "function",
+	[OBJ_INSTANCE] = "instance",
+	[OBJ_LIST] = "list",
+	[OBJ_NATIVE] = "native",
+	[OBJ_STRING] = "string",
+	[OBJ_STRING_DYNAMIC] = "string_dynamic",
+	[OBJ_STRING_ROPE] = "string_rope",
+	[OBJ_STRING_SLICE] = "string_slice",
+	[OBJ_STRING_BUILDER] = "string_builder",
+	[OBJ_UPVALUE] = "upvalue",
+};
+
+static volatile sig_atomic_t dumpRequested = 0;
+
+void recordAllocation(ObjType type, size_t size) {
+	TypeCounters* counters = &typeCounters[type];
+	atomic_fetch_add_explicit(&counters->allocated, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->bytesAllocated, size, memory_order_relaxed);
+}
+
+void recordFree(ObjType type, size_t size) {
+	TypeCounters* counters = &typeCounters[type];
+	atomic_fetch_add_explicit(&counters->freed, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->bytesFreed, size, memory_order_relaxed);
+}
+
+double pauseClock() {
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void recordPause(double seconds) {
+	for (size_t i = 0; i < PAUSE_BUCKET_COUNT; i++) {
+		if (seconds <= pauseBuckets[i]) {
+			pauses.buckets[i]++;
+			break;
+		}
+	}
+	pauses.stats.count++;
+	pauses.stats.total += seconds;
+	if (seconds > pauses.stats.longest) pauses.stats.longest = seconds;
+}
+
+const char* objTypeName(ObjType type) {
+	return typeNames[type];
+}
+
+bool objTypeFromName(const char* name, ObjType* type) {
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+		if (strcmp(typeNames[i], name) == 0) {
+			*type = (ObjType)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+TypeStats typeStats(ObjType type) {
+	TypeCounters* counters = &typeCounters[type];
+	TypeStats stats = {
+		atomic_load_explicit(&counters->allocated, memory_order_relaxed),
+		atomic_load_explicit(&counters->freed, memory_order_relaxed),
+		atomic_load_explicit(&counters->bytesAllocated, memory_order_relaxed),
+		atomic_load_explicit(&counters->bytesFreed, memory_order_relaxed)
+	};
+	return stats;
+}
+
+PauseStats pauseStats() {
+	return pauses.stats;
+}
+
+size_t liveObjects() {
+	size_t live = 0;
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+		TypeStats stats = typeStats((ObjType)i);
+		live += stats.allocated - stats.freed;
+	}
+	return live;
+}
+
+static void writePerType(FILE* file, const char* name, const char* type,
+		const char* help, size_t (*value)(TypeStats*)) {
+	fprintf(file, "# HELP %s %s\n", name, help);
+	fprintf(file, "# TYPE %s %s\n", name, type);
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+		TypeStats stats = typeStats((ObjType)i);
+		fprintf(file, "%s{type=\"%s\"} %zu\n", name, typeNames[i], value(&stats));
+	}
+}
+
+static size_t allocatedOf(TypeStats* stats) { return stats->allocated; }
+static size_t freedOf(TypeStats* stats) { return stats->freed; }
+static size_t bytesAllocatedOf(TypeStats* stats) { return stats->bytesAllocated; }
+static size_t bytesFreedOf(TypeStats* stats) { return stats->bytesFreed; }
+static size_t liveOf(TypeStats* stats) { return stats->allocated - stats->freed; }
+
+bool writeMetrics(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	fprintf(file, "# HELP vlox_gc_collections_total Completed garbage collections.\n");
+	fprintf(file, "# TYPE vlox_gc_collections_total counter\n");
+	fprintf(file, "vlox_gc_collections_total %zu\n", vm.collections);
+
+	fprintf(file, "# HELP vlox_gc_trims_total Times free memory was returned to the OS.\n");
+	fprintf(file, "# TYPE vlox_gc_trims_total counter\n");
+	fprintf(file, "vlox_gc_trims_total %zu\n", vm.trims);
+
+	fprintf(file, "# HELP vlox_gc_region_promoted_bytes_total Bytes copied out of regions that ended.\n");
+	fprintf(file, "# TYPE vlox_gc_region_promoted_bytes_total counter\n");
+	fprintf(file, "vlox_gc_region_promoted_bytes_total %zu\n", vm.promotedBytes);
+
+	fprintf(file, "# HELP vlox_gc_pause_seconds Time the program was stopped by the collector.\n");
+	fprintf(file, "# TYPE vlox_gc_pause_seconds histogram\n");
+	size_t cumulative = 0;
+	for (size_t i = 0; i < PAUSE_BUCKET_COUNT; i++) {
+		cumulative += pauses.buckets[i];
+		fprintf(file, "vlox_gc_pause_seconds_bucket{le=\"%g\"} %zu\n",
+				pauseBuckets[i], cumulative);
+	}
+	fprintf(file, "vlox_gc_pause_seconds_bucket{le=\"+Inf\"} %zu\n", pauses.stats.count);
+	fprintf(file, "vlox_gc_pause_seconds_sum %.9f\n", pauses.stats.total);
+	fprintf(file, "vlox_gc_pause_seconds_count %zu\n", pauses.stats.count);
+
+	fprintf(file, "# HELP vlox_heap_bytes Bytes currently allocated by the VM.\n");
+	fprintf(file, "# TYPE vlox_heap_bytes gauge\n");
+	fprintf(file, "vlox_heap_bytes %zu\n", (size_t)vm.bytesAllocated);
+	fprintf(file, "# HELP vlox_heap_next_gc_bytes Heap size that triggers the next collection.\n");
+	fprintf(file, "# TYPE vlox_heap_next_gc_bytes gauge\n");
+	fprintf(file, "vlox_heap_next_gc_bytes %zu\n", (size_t)vm.nextGC);
+
+	writePerType(file, "vlox_objects_allocated_total", "counter",
+			"Objects allocated, by type.", allocatedOf);
+	writePerType(file, "vlox_objects_freed_total", "counter",
+			"Objects freed, by type.", freedOf);
+	writePerType(file, "vlox_object_bytes_allocated_total", "counter",
+			"Bytes allocated for object headers, by type.", bytesAllocatedOf);
+	writePerType(file, "vlox_object_bytes_freed_total", "counter",
+			"Bytes freed from object headers, by type.", bytesFreedOf);
+	writePerType(file, "vlox_objects_live", "gauge",
+			"Objects not freed yet, by type.", liveOf);
+
+	fprintf(file, "# HELP vlox_interned_strings Used slots in the interned string table, tombstones included.\n");
+	fprintf(file, "# TYPE vlox_interned_strings gauge\n");
+	fprintf(file, "vlox_interned_strings %d\n", vm.strings.count);
+	fprintf(file, "# HELP vlox_interned_strings_capacity Slots in the interned string table.\n");
+	fprintf(file, "# TYPE vlox_interned_strings_capacity gauge\n");
+	fprintf(file, "vlox_interned_strings_capacity %d\n", vm.strings.capacity);
+
+	return fclose(file) == 0;
+}
+
+// Writing the file from the handler itself wouldn't be safe. Leave it
+// for the next safepoint instead.
+static void requestDump(int signal) {
+	dumpRequested = 1;
+	vm.safepointRequested = true;
+}
+
+void watchMetricsSignal() {
+	signal(SIGUSR1, requestDump);
+}
+
+void serviceMetricsRequest() {
+	if (!dumpRequested) return;
+
+	dumpRequested = 0;
+	if (vm.metricsPath != NULL && !writeMetrics(vm.metricsPath)) {
+		fprintf(stderr, "Could not write metrics to \"%s\".\n", vm.metricsPath);
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef vlox_metrics_h
+#define vlox_metrics_h
+
+#include "common.h"
+#include "object.h"
+
+typedef struct {
+	size_t allocated;
+	size_t freed;
+	size_t bytesAllocated;
+	size_t bytesFreed;
+} TypeStats;
+
+typedef struct {
+	size_t count;
+	double total;
+	double longest;
+} PauseStats;
+
+void recordAllocation(ObjType, size_t);
+void recordFree(ObjType, size_t);
+double pauseClock();
+void recordPause(double);
+
+const char* objTypeName(ObjType);
+bool objTypeFromName(const char*, ObjType*);
+TypeStats typeStats(ObjType);
+PauseStats pauseStats();
+size_t liveObjects();
+
+bool writeMetrics(const char*);
+void watchMetricsSignal();
+void serviceMetricsRequest();
+
+#endif // vlox_metrics_h
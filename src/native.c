@@ -1,6 +1,8 @@
 #include "native.h"
+#include "number.h"
 #include "vm.h"
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 static NativeReturn clockNative(int, Value*);
@@ -24,39 +26,45 @@ NativeReturn clockNative(int argCount, Value* args) {
 	return result;
 }
 
-NativeReturn toStringNative(int argCount, Value* args) {
-	NativeReturn result = {INTERPRET_OK, NIL_VAL};
-
-	if (IS_BOOL(args[0])) {
-		if (AS_BOOL(args[0]))
-			result.value = OBJ_VAL(takeString("true", 4));
-		else
-			result.value = OBJ_VAL(takeString("false", 5));
+// Writes what toString() gives for a number, a boolean or nil into
+// buffer, which must hold FORMAT_BUFFER_SIZE characters, and returns its
+// length, or -1 for any other value.
+int formatValue(Value value, char* buffer) {
+	if (IS_BOOL(value)) {
+		if (AS_BOOL(value)) {
+			memcpy(buffer, "true", 5);
+			return 4;
+		}
+		memcpy(buffer, "false", 6);
+		return 5;
 	}
-	else if (IS_INT(args[0])) {
-		char str[128] = "foobar";
-		int64_t i = AS_INT(args[0]);
-		snprintf(str, 128, "%lld", i);
-		result.value = OBJ_VAL(copyString(str, strlen(str)));
+	else if (IS_INT(value)) {
+		return formatInteger(AS_INT(value), buffer);
+	}
+	else if (IS_NUMBER(value)) {
+		return formatNumber(AS_NUMBER(value), buffer);
+	}
+	else if (IS_NIL(value)) {
+		memcpy(buffer, "nil", 4);
+		return 3;
 	}
-	else if (IS_NUMBER(args[0])) {
-		char str[128] = "foobar";
-		double d = AS_NUMBER(args[0]);
-		int i = (int)d;
 
-		if (d == i) {
-			snprintf(str, 128, "%d", i);
-		}
-		else {
-			snprintf(str, 128, "%g", d);
-		}
-		result.value = OBJ_VAL(copyString(str, strlen(str)));
+	return -1;
+}
+
+NativeReturn toStringNative(int argCount, Value* args) {
+	NativeReturn result = {INTERPRET_OK, NIL_VAL};
+	char str[FORMAT_BUFFER_SIZE];
+	int length;
+
+	if (IS_STRING_BUILDER(args[0])) {
+		result.value = OBJ_VAL(stringFromBuilder(AS_STRING_BUILDER(args[0])));
 	}
-	else if (IS_NIL(args[0])) {
-		result.value = OBJ_VAL(takeString("nil", 3));
+	else if ((length = formatValue(args[0], str)) >= 0) {
+		result.value = OBJ_VAL(newString(str, length));
 	}
 	else {
-		vmRuntimeError("toString accepts only numbers or booleans.");
+		vmRuntimeError("toString accepts only numbers, booleans or string builders.");
 		result.status = NATIVE_RUNTIME_ERROR;
 	}
 
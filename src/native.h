@@ -11,7 +11,11 @@ typedef struct {
 
 typedef void (*RegisterNative)(NativeDef*);
 
+// Big enough for anything formatValue() writes.
+#define FORMAT_BUFFER_SIZE 128
+
 void miscNativeFunctions(RegisterNative);
+int formatValue(Value, char*);
 
 #endif // vlox_native_h
 
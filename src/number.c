@@ -0,0 +1,415 @@
+#include <math.h>
+#include <string.h>
+
+#include "number.h"
+
+/*
+ * Numbers as text, without going through printf.
+ *
+ * Integers, and doubles with no fractional part below 2^53, are written
+ * two digits at a time. Any other double is written with the fewest
+ * digits that read back as the same double, found the way Ryu does it
+ * (Ulf Adams, "Ryu: Fast Float-to-String Conversion", PLDI 2018): the
+ * interval of decimals that round to the double is scaled by a 128-bit
+ * approximation of a power of five, and digits are dropped while both
+ * ends of it still differ. Ryu ships those powers as precomputed tables;
+ * here they are worked out with a small bignum the first time a double
+ * needs them.
+ *
+ * The layout follows %g: exponent notation only for very large or very
+ * small magnitudes, "e+XX" with at least two digits.
+ */
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BITS 11
+#define DOUBLE_BIAS 1023
+
+#define POW5_BITCOUNT 125
+#define POW5_INV_BITCOUNT 125
+#define POW5_TABLE_SIZE 326
+#define POW5_INV_TABLE_SIZE 342
+
+// Wide enough for 2^916, the largest dividend computeTables() needs.
+#define BIG_WORDS 32
+
+// Low word first.
+static uint64_t pow5Split[POW5_TABLE_SIZE][2];
+static uint64_t pow5InvSplit[POW5_INV_TABLE_SIZE][2];
+static bool tablesReady = false;
+
+static const char digitPairs[200] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+typedef struct {
+	uint32_t words[BIG_WORDS]; // Low word first.
+	int count;
+} Big;
+
+static void bigMultiply(Big* big, uint32_t factor) {
+	uint64_t carry = 0;
+	for (int i = 0; i < big->count; i++) {
+		uint64_t product = (uint64_t)big->words[i] * factor + carry;
+		big->words[i] = (uint32_t)product;
+		carry = product >> 32;
+	}
+	if (carry != 0) big->words[big->count++] = (uint32_t)carry;
+}
+
+static void bigDivide(Big* big, uint32_t divisor) {
+	uint64_t remainder = 0;
+	for (int i = big->count - 1; i >= 0; i--) {
+		uint64_t dividend = (remainder << 32) | big->words[i];
+		big->words[i] = (uint32_t)(dividend / divisor);
+		remainder = dividend % divisor;
+	}
+	while (big->count > 0 && big->words[big->count - 1] == 0) big->count--;
+}
+
+static int bigBitLength(const Big* big) {
+	if (big->count == 0) return 0;
+	uint32_t top = big->words[big->count - 1];
+	int bits = (big->count - 1) * 32;
+	while (top != 0) {
+		bits++;
+		top >>= 1;
+	}
+	return bits;
+}
+
+// The 64 bits starting at bit `from`, which may be negative.
+static uint64_t bigBits(const Big* big, int from) {
+	uint64_t bits = 0;
+	for (int i = 63; i >= 0; i--) {
+		int bit = from + i;
+		bits <<= 1;
+		if (bit >= 0 && bit < big->count * 32) {
+			bits |= (big->words[bit / 32] >> (bit % 32)) & 1;
+		}
+	}
+	return bits;
+}
+
+// ceil(log2(5^e)), or 1 for e == 0.
+static int pow5Bits(int e) {
+	return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static uint32_t log10Pow2(int e) {
+	return ((uint32_t)e * 78913) >> 18;
+}
+
+static uint32_t log10Pow5(int e) {
+	return ((uint32_t)e * 732923) >> 20;
+}
+
+/*
+ * pow5Split[i] is 5^i cut down (or padded) to its top 125 bits, and
+ * pow5InvSplit[i] is floor(2^(pow5Bits(i) - 1 + 125) / 5^i) + 1.
+ */
+static void computeTables() {
+	Big pow5 = {{1}, 1};
+	for (int i = 0; i < POW5_TABLE_SIZE; i++) {
+		int shift = bigBitLength(&pow5) - POW5_BITCOUNT;
+		pow5Split[i][0] = bigBits(&pow5, shift);
+		pow5Split[i][1] = bigBits(&pow5, shift + 64);
+		bigMultiply(&pow5, 5);
+	}
+
+	for (int i = 0; i < POW5_INV_TABLE_SIZE; i++) {
+		int power = pow5Bits(i) - 1 + POW5_INV_BITCOUNT;
+		Big inverse = {{0}, power / 32 + 1};
+		inverse.words[power / 32] = 1u << (power % 32);
+
+		// Thirteen fives at a time still fit a word.
+		for (int left = i; left > 0; left -= 13) {
+			uint32_t divisor = 1;
+			for (int k = 0; k < left && k < 13; k++) divisor *= 5;
+			bigDivide(&inverse, divisor);
+		}
+
+		uint64_t low = bigBits(&inverse, 0);
+		pow5InvSplit[i][0] = low + 1;
+		pow5InvSplit[i][1] = bigBits(&inverse, 64) + (low == UINT64_MAX);
+	}
+
+	tablesReady = true;
+}
+
+static void multiply128(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low) {
+	uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+	uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+
+	uint64_t lowLow = aLow * bLow;
+	uint64_t lowHigh = aLow * bHigh;
+	uint64_t highLow = aHigh * bLow;
+	uint64_t highHigh = aHigh * bHigh;
+
+	uint64_t middle = highLow + (lowLow >> 32);
+	uint64_t middle2 = lowHigh + (uint32_t)middle;
+	*high = highHigh + (middle >> 32) + (middle2 >> 32);
+	*low = (middle2 << 32) | (uint32_t)lowLow;
+}
+
+// (m * multiplier) >> shift, for 64 < shift < 128.
+static uint64_t mulShift(uint64_t m, const uint64_t* multiplier, int shift) {
+	uint64_t high0, low0, high1, low1;
+	multiply128(m, multiplier[0], &high0, &low0);
+	multiply128(m, multiplier[1], &high1, &low1);
+
+	uint64_t sum = high0 + low1;
+	uint64_t high = high1 + (sum < high0);
+	int distance = shift - 64;
+	return (high << (64 - distance)) | (sum >> distance);
+}
+
+static int pow5Factor(uint64_t value) {
+	int count = 0;
+	while (value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+	return count;
+}
+
+static bool multipleOfPowerOf5(uint64_t value, uint32_t p) {
+	return pow5Factor(value) >= (int)p;
+}
+
+static bool multipleOfPowerOf2(uint64_t value, uint32_t p) {
+	return (value & ((1ull << p) - 1)) == 0;
+}
+
+/*
+ * The shortest decimal that rounds to the finite, non-zero double with
+ * these bits, as digits * 10^exponent.
+ */
+static uint64_t shortestDecimal(uint64_t mantissa, uint32_t biasedExponent, int* exponent) {
+	int e2;
+	uint64_t m2;
+	if (biasedExponent == 0) {
+		e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+		m2 = mantissa;
+	}
+	else {
+		e2 = (int)biasedExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+		m2 = (1ull << DOUBLE_MANTISSA_BITS) | mantissa;
+	}
+	bool acceptBounds = (m2 & 1) == 0;
+
+	// The double, and the midpoints to its neighbours, times four.
+	uint64_t mv = 4 * m2;
+	uint32_t mmShift = mantissa != 0 || biasedExponent <= 1;
+
+	uint64_t vr, vp, vm;
+	int e10;
+	bool vmIsTrailingZeros = false;
+	bool vrIsTrailingZeros = false;
+	if (e2 >= 0) {
+		uint32_t q = log10Pow2(e2) - (e2 > 3);
+		e10 = (int)q;
+		int k = POW5_INV_BITCOUNT + pow5Bits((int)q) - 1;
+		int i = -e2 + (int)q + k;
+		vr = mulShift(4 * m2, pow5InvSplit[q], i);
+		vp = mulShift(4 * m2 + 2, pow5InvSplit[q], i);
+		vm = mulShift(4 * m2 - 1 - mmShift, pow5InvSplit[q], i);
+		if (q <= 21) {
+			// Only these can be exact: 5^22 doesn't fit in 53 bits.
+			if (mv % 5 == 0) {
+				vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+			}
+			else if (acceptBounds) {
+				vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+			}
+			else {
+				vp -= multipleOfPowerOf5(mv + 2, q);
+			}
+		}
+	}
+	else {
+		uint32_t q = log10Pow5(-e2) - (-e2 > 1);
+		e10 = (int)q + e2;
+		int i = -e2 - (int)q;
+		int k = pow5Bits(i) - POW5_BITCOUNT;
+		int j = (int)q - k;
+		vr = mulShift(4 * m2, pow5Split[i], j);
+		vp = mulShift(4 * m2 + 2, pow5Split[i], j);
+		vm = mulShift(4 * m2 - 1 - mmShift, pow5Split[i], j);
+		if (q <= 1) {
+			vrIsTrailingZeros = true;
+			if (acceptBounds) {
+				vmIsTrailingZeros = mmShift == 1;
+			}
+			else {
+				vp--;
+			}
+		}
+		else if (q < 63) {
+			vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+		}
+	}
+
+	// Drop digits while the interval still holds a shorter decimal.
+	int removed = 0;
+	uint64_t output;
+	if (vmIsTrailingZeros || vrIsTrailingZeros) {
+		int lastRemovedDigit = 0;
+		while (vp / 10 > vm / 10) {
+			vmIsTrailingZeros &= vm % 10 == 0;
+			vrIsTrailingZeros &= lastRemovedDigit == 0;
+			lastRemovedDigit = (int)(vr % 10);
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		if (vmIsTrailingZeros) {
+			while (vm % 10 == 0) {
+				vrIsTrailingZeros &= lastRemovedDigit == 0;
+				lastRemovedDigit = (int)(vr % 10);
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				removed++;
+			}
+		}
+		if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+			// Exactly halfway: round to even.
+			lastRemovedDigit = 4;
+		}
+		output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) ||
+				lastRemovedDigit >= 5);
+	}
+	else {
+		// The common case, where nothing is exact.
+		bool roundUp = false;
+		if (vp / 100 > vm / 100) {
+			roundUp = vr % 100 >= 50;
+			vr /= 100;
+			vp /= 100;
+			vm /= 100;
+			removed += 2;
+		}
+		while (vp / 10 > vm / 10) {
+			roundUp = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		output = vr + (vr == vm || roundUp);
+	}
+
+	*exponent = e10 + removed;
+	return output;
+}
+
+static int writeDecimal(uint64_t value, char* buffer) {
+	char digits[20];
+	char* start = digits + sizeof(digits);
+
+	while (value >= 100) {
+		int pair = (int)(value % 100);
+		value /= 100;
+		start -= 2;
+		memcpy(start, digitPairs + 2 * pair, 2);
+	}
+	if (value >= 10) {
+		start -= 2;
+		memcpy(start, digitPairs + 2 * value, 2);
+	}
+	else {
+		*--start = (char)('0' + value);
+	}
+
+	int length = (int)(digits + sizeof(digits) - start);
+	memcpy(buffer, start, length);
+	return length;
+}
+
+int formatInteger(int64_t value, char* buffer) {
+	int length = 0;
+	uint64_t magnitude = (uint64_t)value;
+
+	if (value < 0) {
+		buffer[length++] = '-';
+		magnitude = 0 - magnitude;
+	}
+	length += writeDecimal(magnitude, buffer + length);
+	buffer[length] = '\0';
+	return length;
+}
+
+int formatNumber(double value, char* buffer) {
+	if (isnan(value)) {
+		memcpy(buffer, "nan", 4);
+		return 3;
+	}
+	if (isinf(value)) {
+		memcpy(buffer, value < 0 ? "-inf" : "inf", value < 0 ? 5 : 4);
+		return value < 0 ? 4 : 3;
+	}
+	// Negative zero included.
+	if (fabs(value) < 9007199254740992.0 && value == (double)(int64_t)value) {
+		return formatInteger((int64_t)value, buffer);
+	}
+
+	if (!tablesReady) computeTables();
+
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint64_t mantissa = bits & ((1ull << DOUBLE_MANTISSA_BITS) - 1);
+	uint32_t biasedExponent = (uint32_t)(bits >> DOUBLE_MANTISSA_BITS) &
+			((1u << DOUBLE_EXPONENT_BITS) - 1);
+
+	int exponent;
+	char digits[20];
+	int digitCount = writeDecimal(shortestDecimal(mantissa, biasedExponent, &exponent), digits);
+	// Where the decimal point goes, counting from the first digit.
+	int point = digitCount + exponent;
+
+	int length = 0;
+	if (value < 0) buffer[length++] = '-';
+
+	if (point < -3 || point > 17) {
+		buffer[length++] = digits[0];
+		if (digitCount > 1) {
+			buffer[length++] = '.';
+			memcpy(buffer + length, digits + 1, digitCount - 1);
+			length += digitCount - 1;
+		}
+		int scientific = point - 1;
+		buffer[length++] = 'e';
+		buffer[length++] = scientific < 0 ? '-' : '+';
+		if (scientific < 0) scientific = -scientific;
+		if (scientific < 10) buffer[length++] = '0';
+		length += writeDecimal((uint64_t)scientific, buffer + length);
+	}
+	else if (point <= 0) {
+		buffer[length++] = '0';
+		buffer[length++] = '.';
+		memset(buffer + length, '0', -point);
+		length += -point;
+		memcpy(buffer + length, digits, digitCount);
+		length += digitCount;
+	}
+	else if (point >= digitCount) {
+		memcpy(buffer + length, digits, digitCount);
+		length += digitCount;
+		memset(buffer + length, '0', point - digitCount);
+		length += point - digitCount;
+	}
+	else {
+		memcpy(buffer + length, digits, point);
+		length += point;
+		buffer[length++] = '.';
+		memcpy(buffer + length, digits + point, digitCount - point);
+		length += digitCount - point;
+	}
+
+	buffer[length] = '\0';
+	return length;
+}
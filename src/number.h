@@ -0,0 +1,13 @@
+#ifndef vlox_number_h
+#define vlox_number_h
+
+#include "common.h"
+
+// Big enough for anything formatInteger() or formatNumber() write,
+// terminating NUL included.
+#define NUMBER_BUFFER_SIZE 32
+
+int formatInteger(int64_t, char*);
+int formatNumber(double, char*);
+
+#endif // vlox_number_h
@@ -1,8 +1,14 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
+#include "metrics.h"
+#include "number.h"
 #include "object.h"
+#include "output.h"
+#include "profiler.h"
 #include "value.h"
 #include "vm.h"
 
@@ -10,12 +16,31 @@
 	(type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+	bool inRegion = vm.regionDepth > 0;
+	Obj* object = inRegion ? (Obj*)regionAllocate(size) : (Obj*)reallocate(NULL, 0, size);
 	object->type = type;
-	object->isMarked = false;
+	// Objects born during a concurrent mark are black: nothing they
+	// can point to was unreachable when the snapshot was taken.
+	atomic_init(&object->isMarked, vm.isMarking);
+	atomic_init(&object->scanState, vm.isMarking ? SCAN_DONE : SCAN_PENDING);
 
-	object->next = vm.objects;
-	vm.objects = object;
+	object->isSampled = false;
+
+	if (inRegion) {
+		object->region = REGION_INSIDE;
+		object->next = vm.regionObjects;
+		vm.regionObjects = object;
+	}
+	else {
+		object->region = REGION_OUTSIDE;
+		object->next = vm.objects;
+		vm.objects = object;
+	}
+	recordAllocation(type, size);
+#ifdef DEBUG_VERIFY_HEAP
+	if (!inRegion) verifyObjectType(object);
+#endif
+	if (vm.heapProfileRate > 0) profileAllocation(object, size);
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -39,15 +64,19 @@ ObjClass* newClass(ObjString* name) {
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-	for (int i = 0; i < function->upvalueCount; i++) {
-		upvalues[i] = NULL;
-	}
-
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+	ObjClosure* closure = (ObjClosure*)allocateObject(
+			closureSize(function->upvalueCount, function->captureCount),
+			OBJ_CLOSURE);
 	closure->function = function;
-	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
+	closure->captureCount = function->captureCount;
+	for (int i = 0; i < function->upvalueCount; i++) {
+		closure->upvalues[i] = NULL;
+	}
+	Value* captures = closureCaptures(closure);
+	for (int i = 0; i < function->captureCount; i++) {
+		captures[i] = NIL_VAL;
+	}
 	return closure;
 }
 
@@ -55,7 +84,12 @@ ObjFunction* newFunction() {
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->captureCount = 0;
 	function->name = NULL;
+	function->sharedClosure = NULL;
+	function->localClosure = NULL;
+	function->localClosureSlot = 0;
+	function->nextWeak = NULL;
 	initChunk(&function->chunk);
 	return function;
 }
@@ -101,13 +135,27 @@ void normalizeSlicingIndices(int length, int64_t *start, int64_t *stop, int64_t
 
 ObjList* newList() {
 	ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-	initValueArray(&list->items);
+	list->items.values = list->inlineItems;
+	list->items.count = 0;
+	list->items.capacity = LIST_INLINE_CAPACITY;
 
 	return list;
 }
 
 void appendToList(ObjList* list, Value value) {
-	writeValueArray(&list->items, value);
+	ValueArray* items = &list->items;
+	writeBarrier((Obj*)list);
+
+	if (items->count == items->capacity && isListInline(list)) {
+		// Out of room in the object. Move to the heap.
+		int capacity = GROW_CAPACITY(items->capacity);
+		Value* values = ALLOCATE(Value, capacity);
+		memcpy(values, list->inlineItems, sizeof(Value) * items->count);
+		items->values = values;
+		items->capacity = capacity;
+	}
+
+	writeValueArray(items, value);
 }
 
 Value indexFromList(ObjList* list, int index) {
@@ -117,11 +165,13 @@ Value indexFromList(ObjList* list, int index) {
 }
 
 void storeToList(ObjList* list, int index, Value value) {
+	writeBarrier((Obj*)list);
 	list->items.values[index] = value;
 }
 
 void deleteFromList(ObjList* list, int index) {
 	ValueArray* items = &list->items;
+	writeBarrier((Obj*)list);
 	if (index < 0)
 		index = list->items.count + index;
 
@@ -142,6 +192,8 @@ ObjList* sliceFromList(ObjList* list, int start, int stop, int step) {
 	ObjList* slice = newList();
 	int len = list->items.count;
 
+	push(OBJ_VAL(slice)); // Growing the slice may trigger a collection.
+
 	if (step > 0) {
 		for (int i = start; i >= 0 && i < len && i < stop; i += step) {
 			appendToList(slice, indexFromList(list, i));
@@ -151,6 +203,7 @@ ObjList* sliceFromList(ObjList* list, int start, int stop, int step) {
 			appendToList(slice, indexFromList(list, i));
 		}
 	}
+	pop();
 
 	return slice;
 }
@@ -162,75 +215,294 @@ ObjNative* newNative(NativeFn function, int arity) {
 	return native;
 }
 
-static ObjString* allocateString(int length, uint32_t hash, bool dynamic) {
+static ObjString* allocateString(int length, bool dynamic) {
 	ObjString* string;
 	if (dynamic) {
 		string = (ObjString*)allocateObject(sizeof(ObjStringDynamic) + length + 1, OBJ_STRING_DYNAMIC);
 	} else {
-		string = (ObjString*)allocateObject(sizeof(ObjString), OBJ_STRING);
+		string = (ObjString*)allocateObject(sizeof(ObjStringExternal), OBJ_STRING);
 	}
 	string->length = length;
-	string->hash = hash;
+	string->hash = 0;
+	string->hashed = false;
+	string->interned = false;
 	return string;
 }
 
+/*
+ * String hashing, after xxHash64. It eats eight bytes at a time, in four
+ * independent lanes for long strings, so hashing file contents costs
+ * little more than reading them. The final mix spreads every input bit
+ * over the low bits, which is all a power-of-two table looks at.
+ */
+#define HASH_PRIME1 0x9E3779B185EBCA87ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3 0x165667B19E3779F9ull
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ull
+#define HASH_PRIME5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotateLeft(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t readWord(const char* bytes) {
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+	return word;
+}
+
+static inline uint32_t readHalfWord(const char* bytes) {
+	uint32_t word;
+	memcpy(&word, bytes, sizeof(word));
+	return word;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t word) {
+	acc += word * HASH_PRIME2;
+	acc = rotateLeft(acc, 31);
+	return acc * HASH_PRIME1;
+}
+
+static inline uint64_t mergeLane(uint64_t hash, uint64_t lane) {
+	hash ^= hashRound(0, lane);
+	return hash * HASH_PRIME1 + HASH_PRIME4;
+}
+
 uint32_t hashString(const char* key, int length) {
-	uint32_t hash = 2166136261u;
 	const char* current = key;
-	for (int i = 0; i < length; i++, current++) {
-		hash ^= (uint8_t)*current;
-		hash *= 16777619;
+	const char* end = key + length;
+	uint64_t hash;
+
+	if (length >= 32) {
+		uint64_t lane1 = HASH_PRIME1 + HASH_PRIME2;
+		uint64_t lane2 = HASH_PRIME2;
+		uint64_t lane3 = 0;
+		uint64_t lane4 = -HASH_PRIME1;
+		do {
+			lane1 = hashRound(lane1, readWord(current));
+			lane2 = hashRound(lane2, readWord(current + 8));
+			lane3 = hashRound(lane3, readWord(current + 16));
+			lane4 = hashRound(lane4, readWord(current + 24));
+			current += 32;
+		} while (end - current >= 32);
+
+		hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7)
+			+ rotateLeft(lane3, 12) + rotateLeft(lane4, 18);
+		hash = mergeLane(hash, lane1);
+		hash = mergeLane(hash, lane2);
+		hash = mergeLane(hash, lane3);
+		hash = mergeLane(hash, lane4);
+	}
+	else {
+		hash = HASH_PRIME5;
+	}
+	hash += (uint64_t)length;
+
+	for (; end - current >= 8; current += 8) {
+		hash ^= hashRound(0, readWord(current));
+		hash = rotateLeft(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+	}
+	if (end - current >= 4) {
+		hash ^= (uint64_t)readHalfWord(current) * HASH_PRIME1;
+		hash = rotateLeft(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+		current += 4;
 	}
+	for (; current < end; current++) {
+		hash ^= (uint8_t)*current * HASH_PRIME5;
+		hash = rotateLeft(hash, 11) * HASH_PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= HASH_PRIME3;
+	hash ^= hash >> 32;
+	return (uint32_t)hash;
+}
+
+static uint32_t stringHash(ObjString* string) {
+	if (!string->hashed) {
+		string->hash = hashString(stringChars(string), string->length);
+		string->hashed = true;
+	}
+	return string->hash;
+}
 
-	return hash;
+static void intern(ObjString* string, uint32_t hash) {
+	string->hash = hash;
+	string->hashed = true;
+	string->interned = true;
+	push(OBJ_VAL(string)); // Temporarily push to the stack so that the GC won't reclaim us.
+	tableSet(&vm.strings, string, NIL_VAL);
+	pop();
 }
 
+// For names and literals, which end up as table keys or get compared a
+// lot. Anything made at run time should use newString().
 ObjString* copyString(const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
 	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
 
-	if (interned != NULL) return interned;
+	if (interned != NULL) {
+		// vm.strings is weak. Shade the string before handing it out.
+		writeBarrier((Obj*)interned);
+		return interned;
+	}
 
-	ObjStringDynamic* string = (ObjStringDynamic*)allocateString(length, hash, true);
+	ObjStringDynamic* string = (ObjStringDynamic*)allocateString(length, true);
+	memcpy(string->buffer, chars, length);
+	string->buffer[length] = '\0';
+	intern((ObjString*)string, hash);
+
+	return (ObjString*)string;
+}
+
+// A string for the caller to write its characters into, terminator
+// included. Like newString(), it isn't interned.
+ObjStringDynamic* newStringBuffer(int length) {
+	return (ObjStringDynamic*)allocateString(length, true);
+}
+
+// A string that is neither hashed nor interned until it needs to be.
+ObjString* newString(const char* chars, int length) {
+	ObjStringDynamic* string = (ObjStringDynamic*)allocateString(length, true);
 	memcpy(string->buffer, chars, length);
 	string->buffer[length] = '\0';
-	string->string.chars = string->buffer;
-	push(OBJ_VAL(string)); // Temporarily push to the stack so that the GC won't reclaim us.
-	tableSet(&vm.strings, (ObjString*)string, NIL_VAL);
-	pop();
 
 	return (ObjString*)string;
 }
 
-ObjString* copyStrings(StringList* list) {
-	int length = list->totalLength;
+// NULL when the result would be too long for a string's length.
+ObjString* newRope(ObjString* left, ObjString* right) {
+	if (left->length > INT_MAX - right->length) return NULL;
+
+	ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_STRING_ROPE);
+	rope->string.length = left->length + right->length;
+	rope->chars = NULL;
+	rope->string.hash = 0;
+	rope->string.hashed = false;
+	rope->string.interned = false;
+	rope->left = left;
+	rope->right = right;
+	return (ObjString*)rope;
+}
+
+/*
+ * Fills dest with the rope's characters, back to front. Following right
+ * children and leaving the left ones for later means that the usual
+ * s = s + x chains never have more than one pending.
+ */
+static void writeRopeChars(ObjString* string, char* dest) {
+	ObjString** pending = NULL;
+	int count = 0;
+	int capacity = 0;
+	char* end = dest + string->length;
+
+	for (;;) {
+		while (!isFlat(string)) {
+			ObjRope* rope = (ObjRope*)string;
+			if (capacity < count + 1) {
+				capacity = capacity < 8 ? 8 : capacity * 2;
+				pending = (ObjString**)realloc(pending, sizeof(ObjString*) * capacity);
+				if (pending == NULL) exit(1);
+			}
+			pending[count++] = rope->left;
+			string = rope->right;
+		}
 
-	ObjStringDynamic* string = (ObjStringDynamic*)allocateString(length, 0, true);
-	string->string.chars = &string->buffer[0];
-	char* dest = string->buffer;
-	StringListNode* current = list->first;
-	while (current != NULL) {
-		ObjString* origString = current->string;
-		memcpy(dest, origString->chars, origString->length);
-		dest += origString->length;
-		current = current->next;
+		end -= string->length;
+		memcpy(end, stringChars(string), string->length);
+		if (count == 0) break;
+		string = pending[--count];
 	}
-	*dest = '\0';
-	uint32_t hash = hashString(string->buffer, length);
 
-	ObjString* interned = tableFindString(&vm.strings, string->buffer, length, hash);
+	free(pending);
+}
 
-	if (interned != NULL) {
-		FREE_VARIABLE(ObjStringDynamic, length + 1, string);
-		return interned;
+// Writes the string's characters to dest, without flattening ropes.
+void copyStringChars(ObjString* string, char* dest) {
+	if (isFlat(string)) {
+		memcpy(dest, stringChars(string), string->length);
+	}
+	else {
+		writeRopeChars(string, dest);
 	}
+}
 
-	((ObjString*)string)->hash = hash;
-	push(OBJ_VAL(string)); // Temporarily push to the stack so that the GC won't reclaim us.
-	tableSet(&vm.strings, (ObjString*)string, NIL_VAL);
+// Gives a rope its characters, and lets go of the pieces. Any string
+// will do, but it must not be used after an allocation unless something
+// else keeps it reachable.
+ObjString* flattenString(ObjString* string) {
+	if (isFlat(string)) return string;
+
+	push(OBJ_VAL(string)); // The buffer may cost a collection.
+	char* chars = ALLOCATE(char, string->length + 1);
 	pop();
 
-	return (ObjString*)string;
+	ObjRope* rope = (ObjRope*)string;
+	writeRopeChars(string, chars);
+	chars[string->length] = '\0';
+	writeBarrier((Obj*)rope);
+	rope->left = NULL;
+	rope->right = NULL;
+	rope->chars = chars;
+	return string;
+}
+
+ObjStringBuilder* newStringBuilder() {
+	ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+	builder->length = 0;
+	builder->capacity = 0;
+	builder->chars = NULL;
+	return builder;
+}
+
+// Makes room for at least capacity characters in all. The builder must
+// be reachable, since growing it may collect.
+void reserveStringBuilder(ObjStringBuilder* builder, int capacity) {
+	if (capacity <= builder->capacity) return;
+
+	builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+	builder->capacity = capacity;
+}
+
+static void ensureBuilderRoom(ObjStringBuilder* builder, int length) {
+	int needed = builder->length + length;
+	if (needed <= builder->capacity) return;
+
+	int capacity = GROW_CAPACITY(builder->capacity);
+	reserveStringBuilder(builder, capacity < needed ? needed : capacity);
+}
+
+void appendCharsToBuilder(ObjStringBuilder* builder, const char* chars, int length) {
+	ensureBuilderRoom(builder, length);
+	memcpy(builder->chars + builder->length, chars, length);
+	builder->length += length;
+}
+
+// Ropes are written straight into the builder, without flattening them.
+// Both the builder and the string must be reachable.
+void appendStringToBuilder(ObjStringBuilder* builder, ObjString* string) {
+	ensureBuilderRoom(builder, string->length);
+	copyStringChars(string, builder->chars + builder->length);
+	builder->length += string->length;
+}
+
+// One allocation, however many pieces went in. The builder keeps its
+// contents and can go on growing.
+ObjString* stringFromBuilder(ObjStringBuilder* builder) {
+	return newString(builder->chars == NULL ? "" : builder->chars, builder->length);
+}
+
+// Interned strings are equal when they're the same object. Anything
+// else, ropes included (which must have been flattened), is compared by
+// its characters.
+bool stringsEqual(ObjString* a, ObjString* b) {
+	if (a == b) return true;
+	if (a->interned && b->interned) return false;
+
+	return a->length == b->length && stringHash(a) == stringHash(b)
+		&& memcmp(stringChars(a), stringChars(b), a->length) == 0;
 }
 
 bool isValidStringIndex(ObjString* string, int index) {
@@ -240,36 +512,76 @@ bool isValidStringIndex(ObjString* string, int index) {
 Value indexFromString(ObjString* string, int index) {
 	if (index < 0)
 		index = string->length + index;
+	return OBJ_VAL(vm.singleChars[(uint8_t)stringChars(string)[index]]);
+}
+
+static ObjString* newSlice(ObjString* string, int start, int length) {
+	ObjStringSlice* slice = ALLOCATE_OBJ(ObjStringSlice, OBJ_STRING_SLICE);
+
+	// Slices of slices point into the same parent. Look it up only now:
+	// the allocation could have collected the old one and detached string.
+	ObjString* parent = string;
+	int offset = start;
+	if (string->obj.type == OBJ_STRING_SLICE && ((ObjStringSlice*)string)->parent != NULL) {
+		parent = ((ObjStringSlice*)string)->parent;
+		offset += ((ObjStringSlice*)string)->offset;
+	}
+	// The slice is born black. Make sure the parent gets marked.
+	writeBarrier((Obj*)parent);
+
+	slice->string.length = length;
+	slice->chars = stringChars(parent) + offset;
+	slice->string.hash = 0;
+	slice->string.hashed = false;
+	slice->string.interned = false;
+	slice->parent = parent;
+	slice->offset = offset;
+	slice->nextWeak = NULL;
+	return (ObjString*)slice;
+}
+
+// Gives a slice its own NUL-terminated copy of its characters.
+void detachSlice(ObjStringSlice* slice) {
+	if (slice->parent == NULL) return;
 
-	ObjStringDynamic* newString = (ObjStringDynamic*)allocateString(1, 0, true);
-	newString->buffer[0] = string->chars[index];
-	newString->buffer[1] = '\0';
-	newString->string.chars = newString->buffer;
-	newString->string.hash = hashString(newString->buffer, 1);
+	int length = slice->string.length;
+	push(OBJ_VAL(slice));
+	char* chars = ALLOCATE(char, length + 1);
+	pop();
+	if (slice->parent == NULL) {
+		// The collection that allocation caused did it already.
+		FREE_ARRAY(char, chars, length + 1);
+		return;
+	}
 
-	return OBJ_VAL(newString);
+	memcpy(chars, slice->chars, length);
+	chars[length] = '\0';
+	writeBarrier((Obj*)slice);
+	slice->parent = NULL;
+	slice->chars = chars;
 }
 
+// The string must be flat and reachable. Step-1 slices are views into it.
 ObjString* sliceFromString(ObjString* string, int start, int stop, int step) {
-	char buffer[string->length];
-	char *p = &buffer[0];
 	int len = string->length;
 	int sliceLength = 0;
 
 	if (step > 0) {
-		for (int i = start; i >= 0 && i < len && i < stop; i += step, sliceLength++, p++) {
-			*p = string->chars[i];
-		}
+		for (int i = start; i >= 0 && i < len && i < stop; i += step) sliceLength++;
 	} else if (stop < start) {
-		for (int i = start; i >= 0 && i > stop; i += step, sliceLength++, p++) {
-			*p = string->chars[i];
-		}
+		for (int i = start; i >= 0 && i > stop; i += step) sliceLength++;
 	}
 
-	ObjStringDynamic* slice = (ObjStringDynamic*)allocateString(sliceLength, hashString(buffer, sliceLength), true);
-	memcpy(slice->buffer, buffer, sliceLength);
-	slice->buffer[sliceLength] = '\0';
-	slice->string.chars = slice->buffer;
+	if (sliceLength == 1) return vm.singleChars[(uint8_t)stringChars(string)[start]];
+	if (sliceLength > 1 && step == 1) return newSlice(string, start, sliceLength);
+
+	ObjStringDynamic* slice = (ObjStringDynamic*)allocateString(sliceLength, true);
+	const char* chars = stringChars(string); // Only now, see newSlice().
+	char* p = slice->buffer;
+	for (int i = start, n = 0; n < sliceLength; i += step, n++) {
+		*p++ = chars[i];
+	}
+	*p = '\0';
 
 	return (ObjString*)slice;
 }
@@ -282,12 +594,22 @@ ObjUpvalue* newUpvalue(Value* slot) {
 	return upvalue;
 }
 
+static void writeText(const char* text) {
+	writeOutput(text, strlen(text));
+}
+
+static void writeName(const char* before, ObjString* name, const char* after) {
+	writeText(before);
+	writeOutput(stringChars(name), name->length);
+	writeText(after);
+}
+
 static void printFunction(ObjFunction* function) {
 	if (!function->name) {
-		printf("<script>");
+		writeText("<script>");
 		return;
 	}
-	printf("<fn %s>", function->name->chars);
+	writeName("<fn ", function->name, ">");
 }
 
 ObjString* takeString(char* chars, int length) {
@@ -298,14 +620,13 @@ ObjString* takeString(char* chars, int length) {
 		// NOTE: In the original implementation this function would take
 		//       OWNERSHIP of the string, and so it would free the new
 		//       string a this spot. It doesn't any longer.
+		writeBarrier((Obj*)interned);
 		return interned;
 	}
 
-	ObjString* string = allocateString(length, hash, false);
-	string->chars = chars;
-	push(OBJ_VAL(string)); // Temporarily push to the stack so that the GC won't reclaim us.
-	tableSet(&vm.strings, (ObjString*)string, NIL_VAL);
-	pop();
+	ObjString* string = allocateString(length, false);
+	((ObjStringExternal*)string)->chars = chars;
+	intern(string, hash);
 
 	return string;
 }
@@ -316,7 +637,7 @@ void printObject(Value value) {
 			printFunction(AS_BOUND_METHOD(value)->method->function);
 			break;
 		case OBJ_CLASS:
-			printf("<%s class>", AS_CLASS(value)->name->chars);
+			writeName("<", AS_CLASS(value)->name, " class>");
 			break;
 		case OBJ_CLOSURE:
 			printFunction(AS_CLOSURE(value)->function);
@@ -325,79 +646,64 @@ void printObject(Value value) {
 			printFunction(AS_FUNCTION(value));
 			break;
 		case OBJ_INSTANCE:
-			printf("<%s instance>", AS_INSTANCE(value)->klass->name->chars);
+			writeName("<", AS_INSTANCE(value)->klass->name, " instance>");
 			break;
 		case OBJ_LIST: {
 			ObjList* list = AS_LIST(value);
 			int count = list->items.count;
-			printf("<list [");
+			writeText("<list [");
 			if (count > 0) {
 				int i = 0;
-				printValue(list->items.values[0]);
+				writeValue(list->items.values[0]);
 				for (i = 1; i < count; i++) {
-					printf(", ");
+					writeText(", ");
 					if (i > 5 && count > 7) {
-						printf("...");
+						writeText("...");
 						break;
 					}
-					printValue(list->items.values[i]);
+					writeValue(list->items.values[i]);
 				}
 			}
-			printf("]>");
+			writeText("]>");
 			break;
 		}
 		case OBJ_NATIVE:
-			printf("<native fn>");
+			writeText("<native fn>");
 			break;
 		case OBJ_STRING:
 		case OBJ_STRING_DYNAMIC:
-			printf("%s", AS_CSTRING(value));
+			writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
+			break;
+		case OBJ_STRING_ROPE: {
+			ObjString* string = AS_STRING(value);
+			if (isFlat(string)) {
+				writeOutput(stringChars(string), string->length);
+				break;
+			}
+
+			// Flattening could collect, and whatever holds the rope may
+			// not be reachable any more.
+			char* chars = (char*)malloc(string->length);
+			if (chars == NULL) exit(1);
+			writeRopeChars(string, chars);
+			writeOutput(chars, string->length);
+			free(chars);
+			break;
+		}
+		case OBJ_STRING_SLICE: {
+			ObjString* string = AS_STRING(value);
+			writeOutput(stringChars(string), string->length);
+			break;
+		}
+		case OBJ_STRING_BUILDER: {
+			char count[NUMBER_BUFFER_SIZE];
+			writeText("<string builder, ");
+			writeOutput(count, formatInteger(AS_STRING_BUILDER(value)->length, count));
+			writeText(" chars>");
 			break;
+		}
 		case OBJ_UPVALUE:
-			printf("upvalue");
+			writeText("upvalue");
 			break;
 	}
 }
-
-void initStringList(StringList* list) {
-	list->totalLength = 0;
-	list->first = NULL;
-	list->last = NULL;
-}
-
-void addStringToList(StringList* list, ObjString* string) {
-	StringListNode* node = ALLOCATE(StringListNode, 1);
-	node->string = string;
-	node->next = NULL;
-
-	if (!list->first) {
-		list->first = node;
-	}
-	else {
-		list->last->next = node;
-	}
-	list->last = node;
-	list->totalLength += string->length;
-}
-
-void prependStringToList(StringList* list, ObjString* string) {
-	StringListNode* node = ALLOCATE(StringListNode, 1);
-	node->string = string;
-	node->next = list->first;
-	list->first = node;
-
-	if (!list->last) {
-		list->last = node;
-	}
-	list->totalLength += string->length;
-}
-
-void resetStringList(StringList* list) {
-	StringListNode* current = list->first;
-	while (current != NULL) {
-		StringListNode* next = current->next;
-		FREE(StringListNode, current);
-		current = next;
-	}
-	initStringList(list);
-}
@@ -1,6 +1,8 @@
 #ifndef vlox_object_h
 #define vlox_object_h
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
@@ -16,6 +18,8 @@
 #define IS_LIST(value)		isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)	isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)	isString(value)
+#define IS_STRING_SLICE(value)	isObjType(value, OBJ_STRING_SLICE)
+#define IS_STRING_BUILDER(value)	isObjType(value, OBJ_STRING_BUILDER)
 
 #define AS_BOUND_METHOD(value)	((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)		((ObjClass*)AS_OBJ(value))
@@ -25,7 +29,8 @@
 #define AS_LIST(value)		((ObjList*)AS_OBJ(value))
 #define AS_NATIVE(value)	(((ObjNative*)AS_OBJ(value)))
 #define AS_STRING(value)	((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)	(((ObjString*)AS_OBJ(value))->chars)
+#define AS_CSTRING(value)	(stringChars((ObjString*)AS_OBJ(value)))
+#define AS_STRING_BUILDER(value)	((ObjStringBuilder*)AS_OBJ(value))
 
 typedef enum {
 	OBJ_BOUND_METHOD,
@@ -37,21 +42,56 @@ typedef enum {
 	OBJ_NATIVE,
 	OBJ_STRING,
 	OBJ_STRING_DYNAMIC,
+	OBJ_STRING_ROPE,
+	OBJ_STRING_SLICE,
+	OBJ_STRING_BUILDER,
 	OBJ_UPVALUE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// Only used while marking concurrently. Whoever moves an object from
+// SCAN_PENDING to SCAN_BUSY gets to blacken it.
+typedef enum {
+	SCAN_PENDING,
+	SCAN_BUSY,
+	SCAN_DONE
+} ScanState;
+
+// Where an object lives with respect to region { ... } blocks. Outside
+// objects get remembered when they're changed while a region is open.
+typedef enum {
+	REGION_OUTSIDE,
+	REGION_INSIDE,
+	REGION_REMEMBERED
+} RegionState;
+
 struct Obj {
 	ObjType type;
-	bool isMarked;
+	atomic_bool isMarked;
+	atomic_uchar scanState;
+	bool isSampled;
+	uint8_t region;
 	struct Obj* next;
 };
 
-typedef struct {
+typedef struct ObjFunction {
 	Obj obj;
 	int arity;
 	Chunk chunk;
 	int upvalueCount;
+	int captureCount;
 	ObjString* name;
+	// A function that captures nothing gets a single closure, which
+	// every OP_CLOSURE for it shares.
+	struct ObjClosure* sharedClosure;
+	// The last closure made by OP_CLOSURE_LOCAL, and the stack slot of
+	// the variable holding it. The collector doesn't follow it: once
+	// nothing else reaches the closure, it's cleared.
+	struct ObjClosure* localClosure;
+	int localClosureSlot;
+	// Functions with a local closure, found while marking.
+	struct ObjFunction* nextWeak;
 } ObjFunction;
 
 typedef enum {
@@ -72,18 +112,68 @@ typedef struct {
 	int arity;
 } ObjNative;
 
+// Only identifiers and literals from the source are interned up front.
+// Strings made while running aren't, and get hashed the first time
+// they're compared. Table keys must always be interned.
+// There is no pointer to the characters in here: use stringChars().
 struct ObjString {
 	Obj obj;
 	int length;
-	char* chars;
 	uint32_t hash;
+	bool hashed;
+	bool interned;
 };
 
+// Every string made by the VM keeps its characters right after the header.
 typedef struct ObjStringDynamic {
 	struct ObjString string;
 	char buffer[];
 } ObjStringDynamic;
 
+// A string whose characters it doesn't own, from takeString(). Ropes and
+// slices start the same way, so that stringChars() finds their pointer.
+typedef struct {
+	struct ObjString string;
+	char* chars;
+} ObjStringExternal;
+
+// The result of a long concatenation. Its characters are only put
+// together, in a buffer of its own, once something needs them. Until then
+// chars is NULL. Ropes aren't interned.
+typedef struct {
+	struct ObjString string;
+	char* chars;
+	ObjString* left;
+	ObjString* right;
+} ObjRope;
+
+// Shorter concatenations are copied right away.
+#define ROPE_MIN_LENGTH 64
+
+// A step-1 slice of a string, pointing into its characters, which are
+// not NUL-terminated. When the parent is much longer than the slice, the
+// collector only holds on to it if something else does. Otherwise the
+// slice gets a copy of its own, and no parent.
+typedef struct ObjStringSlice {
+	struct ObjString string;
+	char* chars;
+	ObjString* parent;
+	int offset;
+	// Slices with a weakly held parent, found while marking.
+	struct ObjStringSlice* nextWeak;
+} ObjStringSlice;
+
+#define SLICE_COMPACT_RATIO 4
+
+// A mutable buffer that pieces are appended to in place. Nothing is
+// copied into a string until toString() makes the final one out of it.
+typedef struct {
+	Obj obj;
+	int length;
+	int capacity;
+	char* chars;
+} ObjStringBuilder;
+
 typedef struct ObjUpvalue {
 	Obj obj;
 	Value* location;
@@ -91,22 +181,14 @@ typedef struct ObjUpvalue {
 	struct ObjUpvalue* next;
 } ObjUpvalue;
 
-typedef struct StringListNode {
-	ObjString* string;
-	struct StringListNode* next;
-} StringListNode;
-
-typedef struct StringList {
-	int totalLength;
-	StringListNode* first;
-	StringListNode* last;
-} StringList;
-
-typedef struct {
+// Captured `val`s can't change, so the closure keeps copies of their
+// values right after its upvalues, with no ObjUpvalue in between.
+typedef struct ObjClosure {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalueCount;
+	int captureCount;
+	ObjUpvalue* upvalues[];
 } ObjClosure;
 
 typedef struct {
@@ -128,9 +210,14 @@ typedef struct {
 	ObjClosure* method;
 } ObjBoundMethod;
 
+#define LIST_INLINE_CAPACITY 4
+
+// Short lists keep their items in the object itself. The first append
+// past LIST_INLINE_CAPACITY moves them to the heap for good.
 typedef struct {
 	Obj obj;
 	ValueArray items;
+	Value inlineItems[LIST_INLINE_CAPACITY];
 } ObjList;
 
 ObjBoundMethod* newBoundMethod(Value, ObjClosure*);
@@ -140,17 +227,25 @@ ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass*);
 ObjList* newList();
 ObjNative* newNative(NativeFn, int);
+uint32_t hashString(const char*, int);
 ObjString* takeString(char*, int);
-ObjString* copyStrings(StringList*);
 ObjString* copyString(const char*, int);
+ObjString* newString(const char*, int);
+ObjStringDynamic* newStringBuffer(int);
+void copyStringChars(ObjString*, char*);
+ObjString* newRope(ObjString*, ObjString*);
+ObjString* flattenString(ObjString*);
+void detachSlice(ObjStringSlice*);
+ObjStringBuilder* newStringBuilder();
+void reserveStringBuilder(ObjStringBuilder*, int);
+void appendCharsToBuilder(ObjStringBuilder*, const char*, int);
+void appendStringToBuilder(ObjStringBuilder*, ObjString*);
+ObjString* stringFromBuilder(ObjStringBuilder*);
+bool stringsEqual(ObjString*, ObjString*);
 bool isValidStringIndex(ObjString*, int);
 Value indexFromString(ObjString*, int);
 ObjUpvalue* newUpvalue(Value*);
 void printObject(Value);
-void initStringList(StringList*);
-void addStringToList(StringList*, ObjString*);
-void prependStringToList(StringList*, ObjString*);
-void resetStringList(StringList*);
 ObjString* sliceFromString(ObjString*, int, int, int);
 void appendToList(ObjList*, Value);
 Value indexFromList(ObjList*, int);
@@ -164,8 +259,32 @@ static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline size_t closureSize(int upvalueCount, int captureCount) {
+	return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount
+		+ sizeof(Value) * captureCount;
+}
+
+static inline Value* closureCaptures(ObjClosure* closure) {
+	return (Value*)(closure->upvalues + closure->upvalueCount);
+}
+
+static inline bool isListInline(ObjList* list) {
+	return list->items.values == list->inlineItems;
+}
+
 static inline bool isString(Value value) {
-	return isObjType(value, OBJ_STRING_DYNAMIC) || isObjType(value, OBJ_STRING);
+	return isObjType(value, OBJ_STRING_DYNAMIC) || isObjType(value, OBJ_STRING)
+		|| isObjType(value, OBJ_STRING_ROPE) || isObjType(value, OBJ_STRING_SLICE);
+}
+
+// NULL for a rope that hasn't been flattened.
+static inline char* stringChars(ObjString* string) {
+	if (string->obj.type == OBJ_STRING_DYNAMIC) return ((ObjStringDynamic*)string)->buffer;
+	return ((ObjStringExternal*)string)->chars;
+}
+
+static inline bool isFlat(ObjString* string) {
+	return string->obj.type != OBJ_STRING_ROPE || ((ObjRope*)string)->chars != NULL;
 }
 
 #endif // vlox_object_h
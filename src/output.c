@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "output.h"
+#include "vm.h"
+
+/*
+ * What print writes goes to vm.output first, and only reaches stdout
+ * when it's flushed: after every print when line buffered (the default
+ * on a terminal), or when the buffer fills up when block buffered (the
+ * default otherwise). flush() empties it on demand.
+ *
+ * Anything else written to stdout directly has to flushOutput() first,
+ * or it will come out of order.
+ */
+
+#define RET_OK(val) \
+	{\
+		NativeReturn result = { INTERPRET_OK, val }; \
+		return result; \
+	}
+
+static NativeReturn flush(int, Value*);
+
+static NativeDef nativeFunctions[] = {
+	{ "flush", 0, flush },
+	{ NULL, -1, NULL }
+};
+
+void outputNativeFunctions(RegisterNative addToRegistry) {
+	NativeDef* current = &nativeFunctions[0];
+
+	while (current->name != NULL) {
+		addToRegistry(current++);
+	}
+}
+
+bool setOutputBuffering(const char* name) {
+	if (strcmp(name, "line") == 0) {
+		vm.outputBuffering = OUTPUT_LINE_BUFFERED;
+	}
+	else if (strcmp(name, "block") == 0) {
+		vm.outputBuffering = OUTPUT_BLOCK_BUFFERED;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+void writeOutput(const char* chars, size_t length) {
+	if (vm.outputLength + length > OUTPUT_BUFFER_SIZE) {
+		flushOutput();
+		if (length >= OUTPUT_BUFFER_SIZE) {
+			fwrite(chars, 1, length, stdout);
+			return;
+		}
+	}
+	memcpy(vm.output + vm.outputLength, chars, length);
+	vm.outputLength += length;
+}
+
+void endOutputLine() {
+	writeOutput("\n", 1);
+	if (vm.outputBuffering == OUTPUT_LINE_BUFFERED) flushOutput();
+}
+
+void flushOutput() {
+	if (vm.outputLength > 0) {
+		fwrite(vm.output, 1, vm.outputLength, stdout);
+		vm.outputLength = 0;
+	}
+	fflush(stdout);
+}
+
+NativeReturn flush(int argCount, Value* args) {
+	flushOutput();
+
+	RET_OK(NIL_VAL);
+}
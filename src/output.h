@@ -0,0 +1,19 @@
+#ifndef vlox_output_h
+#define vlox_output_h
+
+#include "native.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+	OUTPUT_LINE_BUFFERED,  // Flushed after every print.
+	OUTPUT_BLOCK_BUFFERED  // Flushed when full, or on flush().
+} OutputBuffering;
+
+void outputNativeFunctions(RegisterNative);
+bool setOutputBuffering(const char*);
+void writeOutput(const char*, size_t);
+void endOutputLine();
+void flushOutput();
+
+#endif // vlox_output_h
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+/*
+ * Sampling heap profiler.
+ *
+ * With vm.heapProfileRate set, roughly one object per that many allocated
+ * bytes is sampled. A sample remembers the Lox call stack that allocated it,
+ * as "script:12;outer:5;inner:7", and the bytes it stands for. The
+ * sample is forgotten when sweep() finds the object unreachable, so the
+ * report holds the live bytes per allocation site, in the folded stack
+ * format used by flame graph tools.
+ *
+ * All of this happens on the main thread. The profiler's own memory is not
+ * part of the Lox heap, so it uses plain malloc() rather than reallocate().
+ */
+typedef struct {
+	char* stack;
+	uint32_t hash;
+	size_t liveBytes;
+	size_t liveObjects;
+} Site;
+
+typedef struct {
+	Obj* object;
+	int site;
+	size_t bytes;
+} Sample;
+
+#define TOMBSTONE ((Obj*)1)
+#define PROFILER_MAX_LOAD 0.75
+
+static struct {
+	Site* sites;
+	int siteCount;
+	int siteCapacity;
+	// Indices into sites + 1, so that 0 means empty.
+	int* siteIndex;
+	int siteIndexCapacity;
+
+	Sample* samples;
+	int sampleCount; // Tombstones included.
+	int sampleCapacity;
+} profiler;
+
+static size_t bytesUntilSample = 0;
+static uint32_t randomState = 2463534242u;
+
+static uint32_t nextRandom() {
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+// Jitter the interval, so that allocations in a loop don't keep
+// sampling the same site.
+static void resetSampleCountdown() {
+	size_t rate = vm.heapProfileRate;
+	bytesUntilSample = rate / 2 + nextRandom() % (rate + 1);
+}
+
+static void* growOrDie(void* pointer, size_t size) {
+	void* result = realloc(pointer, size);
+	if (result == NULL) exit(1);
+	return result;
+}
+
+static uint32_t hashChars(const char* chars) {
+	uint32_t hash = 2166136261u;
+	for (; *chars != '\0'; chars++) {
+		hash ^= (uint8_t)*chars;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static uint32_t hashPointer(Obj* object) {
+	uintptr_t bits = (uintptr_t)object >> 4;
+	return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static void growSiteIndex() {
+	int capacity = profiler.siteIndexCapacity < 64 ? 64 : profiler.siteIndexCapacity * 2;
+	int* index = (int*)growOrDie(NULL, sizeof(int) * capacity);
+	memset(index, 0, sizeof(int) * capacity);
+
+	for (int i = 0; i < profiler.siteCount; i++) {
+		uint32_t slot = profiler.sites[i].hash & (capacity - 1);
+		while (index[slot] != 0) slot = (slot + 1) & (capacity - 1);
+		index[slot] = i + 1;
+	}
+
+	free(profiler.siteIndex);
+	profiler.siteIndex = index;
+	profiler.siteIndexCapacity = capacity;
+}
+
+static int findSite(const char* stack) {
+	if (profiler.siteCount + 1 > profiler.siteIndexCapacity * PROFILER_MAX_LOAD) {
+		growSiteIndex();
+	}
+
+	uint32_t hash = hashChars(stack);
+	uint32_t slot = hash & (profiler.siteIndexCapacity - 1);
+	for (;;) {
+		int entry = profiler.siteIndex[slot];
+		if (entry == 0) break;
+
+		Site* site = &profiler.sites[entry - 1];
+		if (site->hash == hash && strcmp(site->stack, stack) == 0) {
+			return entry - 1;
+		}
+		slot = (slot + 1) & (profiler.siteIndexCapacity - 1);
+	}
+
+	if (profiler.siteCapacity < profiler.siteCount + 1) {
+		profiler.siteCapacity = profiler.siteCapacity < 8 ? 8 : profiler.siteCapacity * 2;
+		profiler.sites = (Site*)growOrDie(profiler.sites, sizeof(Site) * profiler.siteCapacity);
+	}
+
+	Site* site = &profiler.sites[profiler.siteCount];
+	site->stack = (char*)growOrDie(NULL, strlen(stack) + 1);
+	strcpy(site->stack, stack);
+	site->hash = hash;
+	site->liveBytes = 0;
+	site->liveObjects = 0;
+	profiler.siteIndex[slot] = ++profiler.siteCount;
+	return profiler.siteCount - 1;
+}
+
+static Sample* findSample(Sample* samples, int capacity, Obj* object) {
+	uint32_t index = hashPointer(object) & (capacity - 1);
+	Sample* tombstone = NULL;
+
+	for (;;) {
+		Sample* sample = &samples[index];
+		if (sample->object == NULL) {
+			return tombstone != NULL ? tombstone : sample;
+		}
+		else if (sample->object == TOMBSTONE) {
+			if (tombstone == NULL) tombstone = sample;
+		}
+		else if (sample->object == object) {
+			return sample;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+static void growSamples() {
+	int capacity = profiler.sampleCapacity < 64 ? 64 : profiler.sampleCapacity * 2;
+	Sample* samples = (Sample*)growOrDie(NULL, sizeof(Sample) * capacity);
+	memset(samples, 0, sizeof(Sample) * capacity);
+
+	profiler.sampleCount = 0;
+	for (int i = 0; i < profiler.sampleCapacity; i++) {
+		Sample* old = &profiler.samples[i];
+		if (old->object == NULL || old->object == TOMBSTONE) continue;
+
+		*findSample(samples, capacity, old->object) = *old;
+		profiler.sampleCount++;
+	}
+
+	free(profiler.samples);
+	profiler.samples = samples;
+	profiler.sampleCapacity = capacity;
+}
+
+// Writes the folded Lox stack, outermost frame first, into a buffer that
+// stays valid until the next call.
+static const char* currentStack() {
+	static char* buffer = NULL;
+	static size_t capacity = 0;
+	size_t length = 0;
+
+	if (vm.frameCount == 0) return "(compiler)";
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		CallFrame* frame = &vm.frames[i];
+		ObjFunction* function = frame->closure->function;
+		const char* name = function->name == NULL ? "script" : stringChars(function->name);
+		int line = getLine(&function->chunk, (int)(frame->ip - function->chunk.code - 1));
+
+		size_t needed = length + strlen(name) + 16;
+		if (needed > capacity) {
+			capacity = needed * 2;
+			buffer = (char*)growOrDie(buffer, capacity);
+		}
+		length += sprintf(buffer + length, "%s%s:%d", i > 0 ? ";" : "", name, line);
+	}
+
+	return buffer;
+}
+
+void profileAllocation(Obj* object, size_t size) {
+	if (size < bytesUntilSample) {
+		bytesUntilSample -= size;
+		return;
+	}
+	resetSampleCountdown();
+
+	if (profiler.sampleCount + 1 > profiler.sampleCapacity * PROFILER_MAX_LOAD) {
+		growSamples();
+	}
+
+	int site = findSite(currentStack());
+	Sample* sample = findSample(profiler.samples, profiler.sampleCapacity, object);
+	if (sample->object == NULL) profiler.sampleCount++;
+
+	// A small object stands for all the bytes allocated since the last sample.
+	sample->object = object;
+	sample->site = site;
+	sample->bytes = size < vm.heapProfileRate ? vm.heapProfileRate : size;
+	object->isSampled = true;
+
+	profiler.sites[site].liveBytes += sample->bytes;
+	profiler.sites[site].liveObjects++;
+}
+
+void forgetSample(Obj* object) {
+	if (profiler.sampleCapacity == 0) return;
+
+	Sample* sample = findSample(profiler.samples, profiler.sampleCapacity, object);
+	if (sample->object != object) return;
+
+	Site* site = &profiler.sites[sample->site];
+	site->liveBytes -= sample->bytes;
+	site->liveObjects--;
+	sample->object = TOMBSTONE;
+}
+
+void moveSample(Obj* from, Obj* to) {
+	if (profiler.sampleCapacity == 0) return;
+	if (profiler.sampleCount + 1 > profiler.sampleCapacity * PROFILER_MAX_LOAD) {
+		growSamples();
+	}
+
+	Sample* sample = findSample(profiler.samples, profiler.sampleCapacity, from);
+	if (sample->object != from) return;
+
+	Sample moved = *sample;
+	sample->object = TOMBSTONE;
+	moved.object = to;
+	sample = findSample(profiler.samples, profiler.sampleCapacity, to);
+	if (sample->object == NULL) profiler.sampleCount++;
+	*sample = moved;
+}
+
+bool writeHeapProfile(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	for (int i = 0; i < profiler.siteCount; i++) {
+		Site* site = &profiler.sites[i];
+		if (site->liveObjects > 0) {
+			fprintf(file, "%s %zu\n", site->stack, site->liveBytes);
+		}
+	}
+
+	return fclose(file) == 0;
+}
+
+void freeProfiler() {
+	for (int i = 0; i < profiler.siteCount; i++) {
+		free(profiler.sites[i].stack);
+	}
+	free(profiler.sites);
+	free(profiler.siteIndex);
+	free(profiler.samples);
+	memset(&profiler, 0, sizeof(profiler));
+}
@@ -0,0 +1,13 @@
+#ifndef vlox_profiler_h
+#define vlox_profiler_h
+
+#include "common.h"
+#include "object.h"
+
+void profileAllocation(Obj*, size_t);
+void forgetSample(Obj*);
+void moveSample(Obj*, Obj*);
+bool writeHeapProfile(const char*);
+void freeProfiler();
+
+#endif // vlox_profiler_h
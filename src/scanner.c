@@ -4,10 +4,16 @@
 #include "common.h"
 #include "scanner.h"
 
+#define MAX_INTERPOLATION_DEPTH 8
+
 typedef struct {
 	const char* start;
 	const char* current;
 	int line;
+	// For each "${" we're inside of, how many braces are open, itself
+	// included. The string resumes when that gets back to zero.
+	int braces[MAX_INTERPOLATION_DEPTH];
+	int interpolationDepth;
 } Scanner;
 
 Scanner scanner;
@@ -16,6 +22,7 @@ void initScanner(const char* source) {
 	scanner.start = source;
 	scanner.current = source;
 	scanner.line = 1;
+	scanner.interpolationDepth = 0;
 }
 
 static bool isAlpha(char c) {
@@ -156,7 +163,14 @@ static TokenType identifierType() {
 		case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
 		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
 		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+		case 'r':
+			  if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e') {
+				  switch (scanner.start[2]) {
+					  case 'g': return checkKeyword(3, 3, "ion", TOKEN_REGION);
+					  case 't': return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+				  }
+			  }
+			  break;
 		case 's':
 			  if (scanner.current - scanner.start > 1) {
 				  switch (scanner.start[1]) {
@@ -222,8 +236,23 @@ static Token number() {
 	return makeToken(TOKEN_INTEGER);
 }
 
+/*
+ * "a${x}b${y}c" comes out as TOKEN_INTERPOLATION `"a${`, the tokens for
+ * x, TOKEN_INTERPOLATION `}b${`, the tokens for y and TOKEN_STRING `}c"`.
+ * Every piece has one delimiter character at the start and the "${" or
+ * closing quote at the end.
+ */
 static Token string() {
 	while (peek() != '"' && !isAtEnd()) {
+		if (peek() == '$' && peekNext() == '{') {
+			if (scanner.interpolationDepth == MAX_INTERPOLATION_DEPTH) {
+				return errorToken("Interpolation nested too deeply.");
+			}
+			advance();
+			advance();
+			scanner.braces[scanner.interpolationDepth++] = 1;
+			return makeToken(TOKEN_INTERPOLATION);
+		}
 		if (peek() == '\n') scanner.line++;
 		advance();
 	}
@@ -249,8 +278,18 @@ Token scanToken() {
 	switch (c) {
 		case '(': return makeToken(TOKEN_LEFT_PAREN);
 		case ')': return makeToken(TOKEN_RIGHT_PAREN);
-		case '{': return makeToken(TOKEN_LEFT_BRACE);
-		case '}': return makeToken(TOKEN_RIGHT_BRACE);
+		case '{':
+			if (scanner.interpolationDepth > 0) {
+				scanner.braces[scanner.interpolationDepth - 1]++;
+			}
+			return makeToken(TOKEN_LEFT_BRACE);
+		case '}':
+			if (scanner.interpolationDepth > 0
+					&& --scanner.braces[scanner.interpolationDepth - 1] == 0) {
+				scanner.interpolationDepth--;
+				return string();
+			}
+			return makeToken(TOKEN_RIGHT_BRACE);
 		case '[': return makeToken(TOKEN_LEFT_BRACKET);
 		case ']': return makeToken(TOKEN_RIGHT_BRACKET);
 		case ';': return makeToken(TOKEN_SEMICOLON);
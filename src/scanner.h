@@ -16,11 +16,13 @@ typedef enum {
 	TOKEN_LESS, TOKEN_LESS_EQUAL,
 	// Literals
 	TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, TOKEN_INTEGER,
+	// The part of a string before "${". See string() in scanner.c.
+	TOKEN_INTERPOLATION,
 	// Keywords
 	TOKEN_AND, TOKEN_APPEND, TOKEN_BREAK, TOKEN_CASE, TOKEN_CLASS,
 	TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_DELETE, TOKEN_ELSE, TOKEN_FALSE,
 	TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-	TOKEN_PRINT, TOKEN_RETURN, TOKEN_SWITCH, TOKEN_SUPER,
+	TOKEN_PRINT, TOKEN_REGION, TOKEN_RETURN, TOKEN_SWITCH, TOKEN_SUPER,
 	TOKEN_THIS, TOKEN_TRUE, TOKEN_VAL, TOKEN_VAR,
 	TOKEN_WHILE,
 
@@ -0,0 +1,314 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include "memory.h"
+#include "metrics.h"
+#include "object.h"
+#include "snapshot.h"
+#include "table.h"
+#include "vm.h"
+
+/*
+ * Heap snapshots.
+ *
+ * Writes the whole object graph as text, one record per line:
+ *
+ *   root <id> <label>
+ *   object <id> <type> <size> <label>
+ *   edge <from> <to>
+ *
+ * Ids are object addresses in hex. Sizes include the buffers each object
+ * owns (list items, table entries, bytecode...). Labels run to the end of
+ * the line. tools/heapsnap.py reads this and reports dominators and
+ * retained sizes.
+ *
+ * The roots are the ones markRoots() uses, labeled by where they come
+ * from, so a leak can be traced back to a global or a stack slot.
+ */
+
+#define LABEL_MAX 40
+
+static volatile sig_atomic_t snapshotRequested = 0;
+
+static void writeId(FILE* file, Obj* object) {
+	fprintf(file, "%" PRIxPTR, (uintptr_t)object);
+}
+
+static void writeRoot(FILE* file, Value value, const char* label, const char* detail) {
+	if (!IS_OBJ(value)) return;
+
+	fprintf(file, "root ");
+	writeId(file, AS_OBJ(value));
+	fprintf(file, " %s%s\n", label, detail);
+}
+
+static void writeEdge(FILE* file, Obj* from, Obj* to) {
+	if (to == NULL) return;
+
+	fprintf(file, "edge ");
+	writeId(file, from);
+	fputc(' ', file);
+	writeId(file, to);
+	fputc('\n', file);
+}
+
+static void writeValueEdge(FILE* file, Obj* from, Value to) {
+	if (IS_OBJ(to)) writeEdge(file, from, AS_OBJ(to));
+}
+
+static void writeArrayEdges(FILE* file, Obj* from, ValueArray* array) {
+	for (int i = 0; i < array->count; i++) {
+		writeValueEdge(file, from, array->values[i]);
+	}
+}
+
+static void writeTableEdges(FILE* file, Obj* from, Table* table) {
+	for (int i = 0; i < table->capacity; i++) {
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+
+		writeEdge(file, from, (Obj*)entry->key);
+		writeValueEdge(file, from, entry->value);
+	}
+}
+
+static size_t tableSize(Table* table) {
+	return sizeof(Entry) * table->capacity;
+}
+
+static const char* functionName(ObjFunction* function) {
+	return function->name == NULL ? "script" : stringChars(function->name);
+}
+
+// Strings are cut short, and anything that would break the line format
+// is replaced.
+static void writeStringLabel(FILE* file, ObjString* string) {
+	const char* chars = stringChars(string);
+	fputc('"', file);
+	for (int i = 0; i < string->length && i < LABEL_MAX; i++) {
+		char c = chars[i];
+		fputc(c < ' ' || c == 127 ? '.' : c, file);
+	}
+	fputs(string->length > LABEL_MAX ? "\"..." : "\"", file);
+}
+
+static void writeObject(FILE* file, Obj* object) {
+	size_t size = 0;
+
+	switch (object->type) {
+		case OBJ_BOUND_METHOD: size = sizeof(ObjBoundMethod); break;
+		case OBJ_CLASS:
+			size = sizeof(ObjClass) + tableSize(&((ObjClass*)object)->methods);
+			break;
+		case OBJ_CLOSURE:
+			size = closureSize(((ObjClosure*)object)->upvalueCount,
+					((ObjClosure*)object)->captureCount);
+			break;
+		case OBJ_FUNCTION: {
+			Chunk* chunk = &((ObjFunction*)object)->chunk;
+			size = sizeof(ObjFunction) + chunk->capacity
+				+ sizeof(LineInfo) * chunk->lines.capacity
+				+ sizeof(Value) * chunk->constants.capacity;
+			break;
+		}
+		case OBJ_INSTANCE:
+			size = sizeof(ObjInstance) + tableSize(&((ObjInstance*)object)->fields);
+			break;
+		case OBJ_LIST:
+			size = sizeof(ObjList);
+			if (!isListInline((ObjList*)object)) {
+				size += sizeof(Value) * ((ObjList*)object)->items.capacity;
+			}
+			break;
+		case OBJ_NATIVE: size = sizeof(ObjNative); break;
+		case OBJ_STRING: size = sizeof(ObjStringExternal); break;
+		case OBJ_STRING_DYNAMIC:
+			size = sizeof(ObjStringDynamic) + ((ObjString*)object)->length + 1;
+			break;
+		case OBJ_STRING_ROPE:
+			size = sizeof(ObjRope);
+			if (isFlat((ObjString*)object)) size += ((ObjString*)object)->length + 1;
+			break;
+		case OBJ_STRING_SLICE:
+			size = sizeof(ObjStringSlice);
+			if (((ObjStringSlice*)object)->parent == NULL) size += ((ObjString*)object)->length + 1;
+			break;
+		case OBJ_STRING_BUILDER:
+			size = sizeof(ObjStringBuilder) + ((ObjStringBuilder*)object)->capacity;
+			break;
+		case OBJ_UPVALUE: size = sizeof(ObjUpvalue); break;
+	}
+
+	fprintf(file, "object ");
+	writeId(file, object);
+	fprintf(file, " %s %zu ", objTypeName(object->type), size);
+
+	switch (object->type) {
+		case OBJ_BOUND_METHOD:
+			fprintf(file, "%s()", functionName(((ObjBoundMethod*)object)->method->function));
+			break;
+		case OBJ_CLASS:
+			fprintf(file, "class %s", stringChars(((ObjClass*)object)->name));
+			break;
+		case OBJ_CLOSURE:
+			fprintf(file, "%s()", functionName(((ObjClosure*)object)->function));
+			break;
+		case OBJ_FUNCTION:
+			fprintf(file, "%s()", functionName((ObjFunction*)object));
+			break;
+		case OBJ_INSTANCE:
+			fprintf(file, "%s instance", stringChars(((ObjInstance*)object)->klass->name));
+			break;
+		case OBJ_LIST:
+			fprintf(file, "%d items", ((ObjList*)object)->items.count);
+			break;
+		case OBJ_STRING:
+		case OBJ_STRING_DYNAMIC:
+		case OBJ_STRING_SLICE:
+			writeStringLabel(file, (ObjString*)object);
+			break;
+		case OBJ_STRING_ROPE:
+			if (isFlat((ObjString*)object)) {
+				writeStringLabel(file, (ObjString*)object);
+			}
+			else {
+				fprintf(file, "%d chars", ((ObjString*)object)->length);
+			}
+			break;
+		case OBJ_STRING_BUILDER:
+			fprintf(file, "%d chars", ((ObjStringBuilder*)object)->length);
+			break;
+		case OBJ_NATIVE:
+		case OBJ_UPVALUE:
+			break;
+	}
+	fputc('\n', file);
+
+	// The same references blackenObject() follows.
+	switch (object->type) {
+		case OBJ_BOUND_METHOD: {
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			writeValueEdge(file, object, bound->receiver);
+			writeEdge(file, object, (Obj*)bound->method);
+			break;
+		}
+		case OBJ_CLASS: {
+			ObjClass* klass = (ObjClass*)object;
+			writeEdge(file, object, (Obj*)klass->name);
+			writeTableEdges(file, object, &klass->methods);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			writeEdge(file, object, (Obj*)closure->function);
+			for (int i = 0; i < closure->upvalueCount; i++) {
+				writeEdge(file, object, (Obj*)closure->upvalues[i]);
+			}
+			for (int i = 0; i < closure->captureCount; i++) {
+				writeValueEdge(file, object, closureCaptures(closure)[i]);
+			}
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*)object;
+			writeEdge(file, object, (Obj*)function->name);
+			writeEdge(file, object, (Obj*)function->sharedClosure);
+			writeArrayEdges(file, object, &function->chunk.constants);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			ObjInstance* instance = (ObjInstance*)object;
+			writeEdge(file, object, (Obj*)instance->klass);
+			writeTableEdges(file, object, &instance->fields);
+			break;
+		}
+		case OBJ_LIST:
+			writeArrayEdges(file, object, &((ObjList*)object)->items);
+			break;
+		case OBJ_STRING_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			writeEdge(file, object, (Obj*)rope->left);
+			writeEdge(file, object, (Obj*)rope->right);
+			break;
+		}
+		case OBJ_STRING_SLICE:
+			writeEdge(file, object, (Obj*)((ObjStringSlice*)object)->parent);
+			break;
+		case OBJ_UPVALUE:
+			writeValueEdge(file, object, ((ObjUpvalue*)object)->closed);
+			break;
+		case OBJ_NATIVE:
+		case OBJ_STRING:
+		case OBJ_STRING_DYNAMIC:
+		case OBJ_STRING_BUILDER:
+			break;
+	}
+}
+
+static void writeRoots(FILE* file) {
+	char detail[32];
+
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		snprintf(detail, sizeof(detail), "[%d]", (int)(slot - vm.stack));
+		writeRoot(file, *slot, "stack", detail);
+	}
+	for (int i = 0; i < vm.frameCount; i++) {
+		ObjClosure* closure = vm.frames[i].closure;
+		writeRoot(file, OBJ_VAL(closure), "frame ", functionName(closure->function));
+	}
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+		writeRoot(file, OBJ_VAL(upvalue), "open upvalue", "");
+	}
+	for (int i = 0; i < vm.globals.capacity; i++) {
+		Entry* entry = &vm.globals.entries[i];
+		if (entry->key == NULL) continue;
+
+		writeRoot(file, OBJ_VAL(entry->key), "global name ", stringChars(entry->key));
+		writeRoot(file, entry->value, "global ", stringChars(entry->key));
+	}
+	if (vm.initString != NULL) {
+		writeRoot(file, OBJ_VAL(vm.initString), "vm.initString", "");
+	}
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		if (vm.singleChars[i] == NULL) continue;
+		writeRoot(file, OBJ_VAL(vm.singleChars[i]), "vm.singleChars", "");
+	}
+}
+
+bool writeHeapSnapshot(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	// Leave out the garbage, it would only get in the way.
+	collectGarbage();
+
+	fprintf(file, "# vlox heap snapshot\n");
+	writeRoots(file);
+	for (Obj* object = vm.objects; object != NULL; object = object->next) {
+		writeObject(file, object);
+	}
+	for (Obj* object = vm.regionObjects; object != NULL; object = object->next) {
+		writeObject(file, object);
+	}
+
+	return fclose(file) == 0;
+}
+
+static void requestSnapshot(int signal) {
+	snapshotRequested = 1;
+	vm.safepointRequested = true;
+}
+
+void watchSnapshotSignal() {
+	signal(SIGUSR2, requestSnapshot);
+}
+
+void serviceSnapshotRequest() {
+	if (!snapshotRequested) return;
+
+	snapshotRequested = 0;
+	if (vm.heapSnapshotPath != NULL && !writeHeapSnapshot(vm.heapSnapshotPath)) {
+		fprintf(stderr, "Could not write heap snapshot to \"%s\".\n", vm.heapSnapshotPath);
+	}
+}
@@ -0,0 +1,10 @@
+#ifndef vlox_snapshot_h
+#define vlox_snapshot_h
+
+#include "common.h"
+
+bool writeHeapSnapshot(const char*);
+void watchSnapshotSignal();
+void serviceSnapshotRequest();
+
+#endif // vlox_snapshot_h
@@ -79,6 +79,7 @@ static void adjustCapacity(Table* table, int capacity) {
 		Entry* dest = findEntry(entries, capacity, entry->key);
 		dest->key = entry->key;
 		dest->value = entry->value;
+		dest->properties = entry->properties;
 		table->count++;
 	}
 
@@ -87,6 +88,25 @@ static void adjustCapacity(Table* table, int capacity) {
 	table->capacity = capacity;
 }
 
+// Rebuilds the table at a smaller capacity if most of it is empty slots
+// and tombstones.
+void tableShrink(Table* table) {
+	int live = 0;
+	for (int i = 0; i < table->capacity; i++) {
+		if (table->entries[i].key != NULL) live++;
+	}
+
+	if (live == 0) {
+		freeTable(table);
+		return;
+	}
+
+	// Stay well under the load limit so it doesn't grow again right away.
+	int capacity = GROW_CAPACITY(0);
+	while (live > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+	if (capacity < table->capacity) adjustCapacity(table, capacity);
+}
+
 bool tableSet(Table* table, ObjString* key, Value value) {
 	if ((table->count + 1) > (table->capacity * TABLE_MAX_LOAD)) {
 		int capacity = GROW_CAPACITY(table->capacity);
@@ -137,6 +157,17 @@ bool tableDelete(Table* table, ObjString* key) {
 	return true;
 }
 
+// For when the key has moved. The copy hashes the same.
+bool tableReplaceKey(Table* table, ObjString* key, ObjString* replacement) {
+	if (table->count == 0) return false;
+
+	Entry* entry = findEntry(table->entries, table->capacity, key);
+	if (entry->key == NULL) return false;
+
+	entry->key = replacement;
+	return true;
+}
+
 void tableAddAll(Table* from, Table* to) {
 	Entry* entry = from->entries;
 	for (int i = 0; i < from->capacity; i++, entry++) {
@@ -157,7 +188,7 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 			// Stop if we find an empty non-tombstone entry.
 			if (IS_NIL(entry->value)) return NULL;
 		}
-		else if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+		else if (key->length == length && key->hash == hash && memcmp(stringChars(key), chars, length) == 0) {
 			// We found it.
 			return key;
 		}
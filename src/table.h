@@ -29,9 +29,11 @@ bool tableSet(Table*, ObjString*, Value);
 bool tableSetProperties(Table*, ObjString*, uint8_t);
 bool tableUnsetProperties(Table*, ObjString*, uint8_t);
 bool tableDelete(Table*, ObjString*);
+bool tableReplaceKey(Table*, ObjString*, ObjString*);
 void tableAddAll(Table*, Table*);
 ObjString* tableFindString(Table*, const char*, int, uint32_t);
 void tableRemoveWhite(Table*);
+void tableShrink(Table*);
 void markTable(Table*);
 
 #endif // vlox_table_h
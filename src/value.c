@@ -3,6 +3,8 @@
 
 #include "object.h"
 #include "memory.h"
+#include "native.h"
+#include "output.h"
 #include "value.h"
 
 void initValueArray(ValueArray* array) {
@@ -14,9 +16,12 @@ void initValueArray(ValueArray* array) {
 void writeValueArray(ValueArray* array, Value value) {
 	if (array->capacity < (array->count + 1)) {
 		int oldCapacity = array->capacity;
-		array->capacity = GROW_CAPACITY(oldCapacity);
+		int capacity = GROW_CAPACITY(oldCapacity);
+		// Don't touch the capacity until we have the memory: the
+		// allocation may fail with a runtime error.
 		array->values = GROW_ARRAY(Value, array->values,
-				oldCapacity, array->capacity);
+				oldCapacity, capacity);
+		array->capacity = capacity;
 	}
 
 	array->values[array->count] = value;
@@ -38,49 +43,21 @@ void freeValueArray(ValueArray* array) {
 	initValueArray(array);
 }
 
-void printValue(Value value) {
-#ifdef NAN_BOXING
-	if (IS_BOOL(value)) {
-		printf(AS_BOOL(value) ? "true" : "false");
-	}
-	else if (IS_NIL(value)) {
-		printf("nil");
-	}
-	else if (IS_INT(value)) {
-		printf("%lld", AS_INT(value));
-	}
-	else if (IS_NUMBER(value)) {
-		double d = AS_NUMBER(value);
-		int i = (int)d;
-		if (d == i) {
-			printf("%d", i);
-		}
-		else {
-			printf("%g", d);
-		}
-	}
-	else if (IS_OBJ(value)) {
+// Into the output buffer, for print.
+void writeValue(Value value) {
+	if (IS_OBJ(value)) {
 		printObject(value);
+		return;
 	}
-#else
-	switch (value.type) {
-		case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-		case VAL_NIL: printf("nil"); break;
-		case VAL_INT: printf("%lld", AS_INT(value));
-		case VAL_NUMBER: {
-			double d = AS_NUMBER(value);
-			int i = (int)d;
-			if (d == i) {
-				printf("%d", i);
-			}
-			else {
-				printf("%g", d);
-			}
-			break;
-		}
-		case VAL_OBJ: printObject(value); break;
-	}
-#endif
+
+	char buffer[FORMAT_BUFFER_SIZE];
+	writeOutput(buffer, formatValue(value, buffer));
+}
+
+// Straight to stdout, for debugging output written with printf().
+void printValue(Value value) {
+	writeValue(value);
+	flushOutput();
 }
 
 bool valuesEqual(Value a, Value b) {
@@ -91,6 +68,8 @@ bool valuesEqual(Value a, Value b) {
 	if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
 		return (IS_INT(a) ? AS_INT(a) : AS_NUMBER(a)) == (IS_INT(b) ? AS_INT(b) : AS_NUMBER(b));
 	}
+	else if (IS_STRING(a) && IS_STRING(b))
+		return stringsEqual(AS_STRING(a), AS_STRING(b));
 	else
 		return a == b;
 #else
@@ -107,7 +86,9 @@ bool valuesEqual(Value a, Value b) {
 	switch (a.type) {
 		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL: return true;
-		case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(a);
+		case VAL_OBJ:
+			if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+			return AS_OBJ(a) == AS_OBJ(b);
 		default: return false; // Unreachable
 	}
 #endif
@@ -114,6 +114,7 @@ void initValueArray(ValueArray*);
 void writeValueArray(ValueArray*, Value);
 void maybeShrinkArray(ValueArray*);
 void freeValueArray(ValueArray*);
+void writeValue(Value);
 void printValue(Value);
 
 #endif // vlox_value_h
@@ -1,15 +1,21 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
 #include "native.h"
+#include "profiler.h"
 #include "list.h"
+#include "builder.h"
+#include "gc.h"
+#include "output.h"
 #include "vm.h"
 
 VM vm;
@@ -18,9 +24,14 @@ static void resetStack() {
 	vm.stackTop = vm.stack;
 	vm.frameCount = 0;
 	vm.openUpvalues = NULL;
+	// The code that would have ended them won't run.
+	exitAllRegions();
 }
 
 void vmRuntimeError(const char* format, ...) {
+	// Whatever was printed before the error comes out before it.
+	flushOutput();
+
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
@@ -37,7 +48,7 @@ void vmRuntimeError(const char* format, ...) {
 			fprintf(stderr, "script\n");
 		}
 		else {
-			fprintf(stderr, "%s()\n", function->name->chars);
+			fprintf(stderr, "%s()\n", stringChars(function->name));
 		}
 	}
 
@@ -47,51 +58,110 @@ void vmRuntimeError(const char* format, ...) {
 static void defineNative(NativeDef* definition) {
 	push(OBJ_VAL(copyString(definition->name, (int)strlen(definition->name))));
 	push(OBJ_VAL(newNative(definition->func, definition->arity)));
+	globalsWriteBarrier(vm.stack[1]);
 	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
 	pop();
 	pop();
 }
 
 void initVM() {
-	vm.stack = (Value*)reallocate(NULL, 0, sizeof(Value) * STACK_SLICE_SIZE);
-	vm.stackLimit = vm.stack + STACK_SLICE_SIZE;
-	resetStack();
 	vm.objects = NULL;
+	vm.regionObjects = NULL;
+	vm.regionDepth = 0;
+	vm.promotedBytes = 0;
 	vm.bytesAllocated = 0;
 	vm.nextGC = 1024 * 1024;
+	vm.stack = (Value*)reallocate(NULL, 0, sizeof(Value) * STACK_SLICE_SIZE);
+	vm.stackLimit = vm.stack + STACK_SLICE_SIZE;
+	resetStack();
 
 	vm.grayCount = 0;
 	vm.grayCapacity = 0;
 	vm.grayStack = NULL;
+	vm.sweepInBackground = false;
+	vm.markThreads = 1;
+	vm.markConcurrently = false;
+	vm.isMarking = false;
+	vm.safepointRequested = false;
+	vm.compactionThreshold = 0;
+	vm.compactionRequested = false;
+	vm.heapGrowthFactorGiven = false;
+	vm.minHeapGiven = false;
+	setGcPolicy("balanced");
+	vm.maxHeap = 0;
+	vm.collections = 0;
+	vm.trimInterval = 1;
+	vm.trims = 0;
+	vm.metricsPath = NULL;
+	vm.heapProfileRate = 0;
+	vm.heapProfilePath = NULL;
+	vm.heapSnapshotPath = NULL;
+	vm.outOfMemory = NULL;
+	vm.outputBuffering = isatty(STDOUT_FILENO) ? OUTPUT_LINE_BUFFERED : OUTPUT_BLOCK_BUFFERED;
+	vm.outputLength = 0;
 
 	initTable(&vm.globals);
 	initTable(&vm.strings);
 
 	vm.initString = NULL;
 	vm.initString = copyString("init", 4);
+	// Making them may collect, which marks the whole array.
+	for (int i = 0; i < UINT8_COUNT; i++) vm.singleChars[i] = NULL;
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		char c = (char)i;
+		vm.singleChars[i] = copyString(&c, 1);
+	}
 
 	miscNativeFunctions(defineNative);
 	listNativeFunctions(defineNative);
+	builderNativeFunctions(defineNative);
+	gcNativeFunctions(defineNative);
+	outputNativeFunctions(defineNative);
 }
 
 void freeVM() {
+	flushOutput();
 	freeTable(&vm.globals);
 	freeTable(&vm.strings);
 	vm.initString = NULL;
+	for (int i = 0; i < UINT8_COUNT; i++) vm.singleChars[i] = NULL;
 	freeObjects();
-	free(vm.stack);
+	freeProfiler();
+	FREE_ARRAY(Value, vm.stack, vm.stackLimit - vm.stack);
+
+#ifdef DEBUG_VERIFY_HEAP
+	verifyHeapAtExit();
+#endif
+}
+
+static void resizeStack(int capacity) {
+	Value* oldStack = vm.stack;
+	Value* newStack = GROW_ARRAY(Value, vm.stack, vm.stackLimit - vm.stack, capacity);
+	vm.stackLimit = newStack + capacity;
+	if (newStack == oldStack) return;
+
+	// Everything pointing into the stack has to follow it.
+	vm.stack = newStack;
+	vm.stackTop = newStack + (vm.stackTop - oldStack);
+	for (int i = 0; i < vm.frameCount; i++) {
+		vm.frames[i].slots = newStack + (vm.frames[i].slots - oldStack);
+	}
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+		upvalue->location = newStack + (upvalue->location - oldStack);
+	}
+}
+
+void shrinkStack() {
+	int capacity = vm.stackLimit - vm.stack;
+	int used = vm.stackTop - vm.stack;
+	// Leave some headroom so that the next call doesn't grow it right back.
+	int wanted = (used * 2 / STACK_SLICE_SIZE + 1) * STACK_SLICE_SIZE;
+	if (wanted < capacity) resizeStack(wanted);
 }
 
 void push(Value value) {
 	if (vm.stackTop == vm.stackLimit) {
-		int size = vm.stackLimit - vm.stack;
-		int newSize = size + STACK_SLICE_SIZE;
-		Value *newStack = GROW_ARRAY(Value, vm.stack, size, newSize);
-		if (newStack != vm.stack) {
-			vm.stack = newStack;
-			vm.stackTop = vm.stack + size;
-		}
-		vm.stackLimit = vm.stack + newSize;
+		resizeStack(vm.stackLimit - vm.stack + STACK_SLICE_SIZE);
 	}
 	*vm.stackTop = value;
 	vm.stackTop++;
@@ -141,6 +211,11 @@ inline Value peek(int distance) {
 	return vm.stackTop[-1 - distance];
 }
 
+// Makes sure a string has its characters. See ObjRope.
+static void flattenValue(Value value) {
+	if (IS_STRING(value)) flattenString(AS_STRING(value));
+}
+
 static bool call(ObjClosure* closure, int argCount) {
 	ObjFunction* function = closure->function;
 
@@ -189,6 +264,14 @@ static bool callValue(Value callee, int argCount) {
 					vmRuntimeError("Expected %d arguments but got %d.", native->arity, argCount);
 					return false;
 				}
+				// Natives only ever see flat, NUL-terminated strings. Both
+				// calls push, which may move the stack, so don't hold on to
+				// pointers into it.
+				for (int i = argCount; i > 0; i--) {
+					flattenValue(vm.stackTop[-i]);
+					Value arg = vm.stackTop[-i];
+					if (IS_STRING_SLICE(arg)) detachSlice((ObjStringSlice*)AS_OBJ(arg));
+				}
 				NativeReturn result = native->function(argCount, vm.stackTop - argCount);
 				if (result.status != NATIVE_OK) {
 					return false;
@@ -208,7 +291,7 @@ static bool callValue(Value callee, int argCount) {
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
 	Value method;
 	if (!tableGet(&klass->methods, name, &method)) {
-		vmRuntimeError("Undefined property '%s'.", name->chars);
+		vmRuntimeError("Undefined property '%s'.", stringChars(name));
 		return false;
 	}
 	return call(AS_CLOSURE(method), argCount);
@@ -236,7 +319,7 @@ static bool invoke(ObjString* name, int argCount) {
 static bool bindMethod(ObjClass* klass, ObjString* name) {
 	Value method;
 	if (!tableGet(&klass->methods, name, &method)) {
-		vmRuntimeError("Undefined property '%s'.", name->chars);
+		vmRuntimeError("Undefined property '%s'.", stringChars(name));
 		return false;
 	}
 
@@ -274,20 +357,22 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 static void closeUpvalues(Value* last) {
 	while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
 		ObjUpvalue* upvalue = vm.openUpvalues;
+		writeBarrier((Obj*)upvalue);
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
 		vm.openUpvalues = upvalue->next;
+		// Left alone, it would point at whatever opened next, which may
+		// be long gone by the time the upvalue gets forwarded.
+		upvalue->next = NULL;
 	}
 }
 
 static void defineMethod(ObjString* name) {
 	Value method = peek(0);
 	ObjClass* klass = AS_CLASS(peek(1));
-	{
-		ObjClosure* closure = AS_CLOSURE(method);
-		if (memcmp(closure->function->name->chars, "init", 4) == 0) {
-			klass->initializer = closure;
-		}
+	writeBarrier((Obj*)klass);
+	if (name == vm.initString) {
+		klass->initializer = AS_CLOSURE(method);
 	}
 	tableSet(&klass->methods, name, method);
 	pop();
@@ -302,18 +387,87 @@ static bool isFalsey(Value value) {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-	StringList sl;
-
-	initStringList(&sl);
-	addStringToList(&sl, AS_STRING(peek(0)));
-	prependStringToList(&sl, AS_STRING(peek(1)));
-	ObjString* result= copyStrings(&sl);
+// Building a long string a piece at a time would copy it over and over,
+// so long results are ropes, which only get flattened when needed.
+static bool concatenate() {
+	ObjString* a = AS_STRING(peek(1));
+	ObjString* b = AS_STRING(peek(0));
+	// Ropes make doubling a string cheap, so this is easy to reach.
+	if (a->length > INT_MAX - b->length) {
+		vmRuntimeError("String too long.");
+		return false;
+	}
+	int length = a->length + b->length;
+	ObjString* result;
+
+	if (length < ROPE_MIN_LENGTH) {
+		// Ropes are longer than that, so both are flat.
+		char chars[ROPE_MIN_LENGTH];
+		memcpy(chars, stringChars(a), a->length);
+		memcpy(chars + a->length, stringChars(b), b->length);
+		result = newString(chars, length);
+	}
+	else {
+		result = newRope(a, b);
+	}
 	pop();
 	replace(OBJ_VAL(result));
-	resetStringList(&sl);
+	return true;
+}
+
+/*
+ * Puts the top count values together for an interpolated string: strings
+ * as they are, and numbers, booleans and nil the way toString() writes
+ * them. The result is sized first, so it takes a single allocation.
+ */
+static bool formatString(int count) {
+	Value* parts = vm.stackTop - count;
+	char scratch[FORMAT_BUFFER_SIZE];
+	int length = 0;
+
+	if (count == 1 && IS_STRING(parts[0])) return true;
+
+	for (int i = 0; i < count; i++) {
+		int partLength;
+		if (IS_STRING(parts[i])) {
+			partLength = AS_STRING(parts[i])->length;
+		}
+		else if ((partLength = formatValue(parts[i], scratch)) < 0) {
+			vmRuntimeError("Can only interpolate strings, numbers, booleans or nil.");
+			return false;
+		}
+
+		if (partLength > INT_MAX - length) {
+			vmRuntimeError("String too long.");
+			return false;
+		}
+		length += partLength;
+	}
+
+	// The parts stay on the stack until it's done.
+	ObjStringDynamic* result = newStringBuffer(length);
+	char* dest = result->buffer;
+	parts = vm.stackTop - count;
+	for (int i = 0; i < count; i++) {
+		if (IS_STRING(parts[i])) {
+			ObjString* part = AS_STRING(parts[i]);
+			copyStringChars(part, dest);
+			dest += part->length;
+		}
+		else {
+			int partLength = formatValue(parts[i], scratch);
+			memcpy(dest, scratch, partLength);
+			dest += partLength;
+		}
+	}
+	*dest = '\0';
+
+	popMany(count);
+	push(OBJ_VAL(result));
+	return true;
 }
 
+
 typedef enum {
 	ArithAdd,
 	ArithSub,
@@ -403,6 +557,22 @@ static bool doBool(BoolOp op) {
 	return true;
 }
 
+// The compiler only emits OP_CLOSURE_LOCAL for closures that never leave
+// the variable they're declared in, so the previous one is garbage once
+// that variable's slot holds something else.
+static ObjClosure* recycleClosure(ObjFunction* function) {
+	ObjClosure* closure = function->localClosure;
+	if (closure == NULL) return NULL;
+
+	Value* slot = vm.stack + function->localClosureSlot;
+	if (slot < vm.stackTop && IS_OBJ(*slot) && AS_OBJ(*slot) == (Obj*)closure) {
+		return NULL;
+	}
+
+	writeBarrier((Obj*)closure);
+	return closure;
+}
+
 static InterpretResult run() {
 	CallFrame* frame = &vm.frames[vm.frameCount - 1];
 //	printObject(OBJ_VAL(frame->closure->function)); printf("\n");
@@ -418,6 +588,10 @@ static InterpretResult run() {
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
 	} while (false)
+#define SAFEPOINT() \
+	do { \
+		if (vm.safepointRequested) runSafepoint(); \
+	} while (false)
 #define BIN_ARITH(op) \
 	do { \
 		if (!doArith(op)) { \
@@ -463,7 +637,7 @@ static InterpretResult run() {
 				ObjString* name = READ_STRING();
 				Value value;
 				if (!tableGet(&vm.globals, name, &value)) {
-					vmRuntimeError("Undefined variable '%s'.", name->chars);
+					vmRuntimeError("Undefined variable '%s'.", stringChars(name));
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				push(value);
@@ -472,6 +646,7 @@ static InterpretResult run() {
 			case OP_DEFINE_IGLOBAL:
 			case OP_DEFINE_GLOBAL: {
 				ObjString* name = READ_STRING();
+				globalsWriteBarrier(peek(0));
 				tableSet(&vm.globals, name, peek(0));
 				if (instruction == OP_DEFINE_IGLOBAL) {
 					tableSetProperties(&vm.globals, name, TABLE_IMMUTABLE);
@@ -488,13 +663,14 @@ static InterpretResult run() {
 				ObjString* name = READ_STRING();
 				uint8_t properties;
 				if (!tableGetProperties(&vm.globals, name, &properties)) {
-					vmRuntimeError("Undefined variable '%s'.", name->chars);
+					vmRuntimeError("Undefined variable '%s'.", stringChars(name));
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				else if (properties & TABLE_IMMUTABLE) {
-					vmRuntimeError("Unable to assign a value to immutable '%s'.", name->chars);
+					vmRuntimeError("Unable to assign a value to immutable '%s'.", stringChars(name));
 					return INTERPRET_RUNTIME_ERROR;
 				}
+				globalsWriteBarrier(peek(0));
 				tableSet(&vm.globals, name, peek(0));
 				break;
 			}
@@ -505,7 +681,14 @@ static InterpretResult run() {
 			}
 			case OP_SET_UPVALUE: {
 				uint8_t slot = READ_BYTE();
-				*frame->closure->upvalues[slot]->location = peek(0);
+				ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+				writeBarrier((Obj*)upvalue);
+				*upvalue->location = peek(0);
+				break;
+			}
+			case OP_GET_CAPTURED: {
+				uint8_t slot = READ_BYTE();
+				push(closureCaptures(frame->closure)[slot]);
 				break;
 			}
 			case OP_GET_PROPERTY: {
@@ -536,6 +719,7 @@ static InterpretResult run() {
 				}
 
 				ObjInstance* instance = AS_INSTANCE(peek(1));
+				writeBarrier((Obj*)instance);
 				tableSet(&instance->fields, READ_STRING(), peek(0));
 				Value value = pop();
 				pop();
@@ -552,12 +736,16 @@ static InterpretResult run() {
 				break;
 			}
 			case OP_EQUAL_NO_POP: {
+				       flattenValue(peek(0));
+				       flattenValue(peek(1));
 				       Value b = peek(0);
-				       Value a = peek(-1);
+				       Value a = peek(1);
 				       replace(BOOL_VAL(valuesEqual(a, b)));
 				       break;
 			       }
 			case OP_EQUAL: {
+				       flattenValue(peek(0));
+				       flattenValue(peek(1));
 				       Value b = pop();
 				       Value a = peek(0);
 				       replace(BOOL_VAL(valuesEqual(a, b)));
@@ -569,7 +757,7 @@ static InterpretResult run() {
 				Value va = peek(1);
 				Value vb = peek(0);
 				if (IS_STRING(va) && IS_STRING(vb)) {
-					concatenate();
+					if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
 				}
 				else if (IS_NUMERIC(va) && IS_NUMERIC(vb)) {
 					doArith(ArithAdd);
@@ -601,8 +789,9 @@ static InterpretResult run() {
 				break;
 			}
 			case OP_PRINT: {
-				printValue(pop());
-				printf("\n");
+				flattenValue(peek(0));
+				writeValue(pop());
+				endOutputLine();
 				break;
 			}
 			case OP_JUMP: {
@@ -618,6 +807,7 @@ static InterpretResult run() {
 			case OP_LOOP: {
 				uint16_t offset = READ_SHORT();
 				frame->ip -= offset;
+				SAFEPOINT();
 				break;
 			}
 			case OP_CALL: {
@@ -626,6 +816,7 @@ static InterpretResult run() {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 			case OP_INVOKE: {
@@ -635,6 +826,7 @@ static InterpretResult run() {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 			case OP_SUPER_INVOKE: {
@@ -645,12 +837,38 @@ static InterpretResult run() {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
-			case OP_CLOSURE: {
+			case OP_CLOSURE:
+			case OP_CLOSURE_LOCAL: {
 				ObjFunction* function = AS_FUNCTION(readConstant());
-				ObjClosure* closure = newClosure(function);
+				if (function->upvalueCount == 0 && function->captureCount == 0) {
+					if (function->sharedClosure == NULL) {
+						ObjClosure* closure = newClosure(function);
+						writeBarrier((Obj*)function);
+						function->sharedClosure = closure;
+					}
+					push(OBJ_VAL(function->sharedClosure));
+					break;
+				}
+
+				ObjClosure* closure = NULL;
+				if (instruction == OP_CLOSURE_LOCAL) {
+					closure = recycleClosure(function);
+				}
+				if (closure == NULL) closure = newClosure(function);
 				push(OBJ_VAL(closure));
+				if (instruction == OP_CLOSURE_LOCAL) {
+					if (function->localClosure != closure) {
+						writeBarrier((Obj*)function);
+						function->localClosure = closure;
+					}
+					// Only the mutator reads the slot, and a recycled
+					// closure may land in a different one.
+					function->localClosureSlot = vm.stackTop - 1 - vm.stack;
+				}
+
 				for (int i = 0; i < closure->upvalueCount; i++) {
 					uint8_t isLocal = READ_BYTE();
 					uint8_t index = READ_BYTE();
@@ -661,8 +879,27 @@ static InterpretResult run() {
 						closure->upvalues[i] = frame->closure->upvalues[index];
 					}
 				}
+				Value* captures = closureCaptures(closure);
+				for (int i = 0; i < closure->captureCount; i++) {
+					uint8_t isLocal = READ_BYTE();
+					uint8_t index = READ_BYTE();
+					if (isLocal) {
+						captures[i] = frame->slots[index];
+					}
+					else {
+						captures[i] = closureCaptures(frame->closure)[index];
+					}
+				}
 				break;
 			}
+			case OP_REGION_BEGIN:
+				enterRegion();
+				break;
+			case OP_REGION_END:
+				// Whatever escaped gets moved, so nothing here may hold on
+				// to an object across this.
+				exitRegion();
+				break;
 			case OP_CLOSE_UPVALUE:
 				closeUpvalues(vm.stackTop - 1);
 				pop();
@@ -679,6 +916,7 @@ static InterpretResult run() {
 				vm.stackTop = frame->slots;
 				push(result);
 				frame = &vm.frames[vm.frameCount - 1];
+				SAFEPOINT();
 				break;
 			}
 			case OP_CLASS:
@@ -692,6 +930,7 @@ static InterpretResult run() {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ObjClass* subclass = AS_CLASS(peek(0));
+				writeBarrier((Obj*)subclass);
 				tableAddAll(&AS_CLASS(superclass)->methods,
 					    &subclass->methods);
 				pop(); // Subclass.
@@ -714,16 +953,33 @@ static InterpretResult run() {
 				push(OBJ_VAL(list));
 				break;
 			}
+			case OP_FORMAT: {
+				int count = readConstantIndex(NULL);
+				if (!formatString(count)) return INTERPRET_RUNTIME_ERROR;
+				break;
+			}
 			case OP_APPEND_TO: {
-				Value element = pop();
-				Value vList = pop();
+				// Growing the list or builder may trigger a collection.
+				// Leave both on the stack until we're done.
+				Value element = peek(0);
+				Value vList = peek(1);
+
+				if (IS_STRING_BUILDER(vList)) {
+					if (!appendToBuilder(AS_STRING_BUILDER(vList), element)) {
+						vmRuntimeError("Can only append strings, numbers, booleans or nil to a string builder.");
+						return INTERPRET_RUNTIME_ERROR;
+					}
+					popMany(2);
+					break;
+				}
 
 				if (!IS_OBJ(vList) || !IS_LIST(vList)) {
-					vmRuntimeError("Can only append to a list.");
+					vmRuntimeError("Can only append to a list or a string builder.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				appendToList(AS_LIST(vList), element);
+				popMany(2);
 				break;
 			}
 			case OP_DELETE_FROM: {
@@ -754,6 +1010,7 @@ static InterpretResult run() {
 			}
 			case OP_INDEX_SUBSCR:
 			{
+				flattenValue(peek(1));
 				Value vIndex = pop();
 				Value vIndexed = pop();
 				Value result;
@@ -798,8 +1055,9 @@ static InterpretResult run() {
 				Value vStep = pop();
 				Value vStop = pop();
 				Value vStart = pop();
-				Value vSliced = pop();
+				Value vSliced = peek(0); // Keep it reachable while slicing.
 				Value result;
+				flattenValue(vSliced);
 
 				if (!IS_INT(vStart) || !(IS_INT(vStop) || IS_NIL(vStop)) || !IS_INT(vStep)) {
 					vmRuntimeError("Slice indices must be integers");
@@ -833,6 +1091,7 @@ static InterpretResult run() {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
+				pop();
 				push(result);
 				break;
 			}
@@ -872,17 +1131,35 @@ static InterpretResult run() {
 #undef READ_STRING
 #undef READ_LONG_CONSTANT
 #undef BIN_BOOL
+#undef SAFEPOINT
 #undef BIN_ARITH
 }
 
 InterpretResult interpret(const char* source) {
+	jmp_buf outOfMemory;
+	InterpretResult result;
+
+	// Running out of heap lands here, with the error already reported.
+	if (setjmp(outOfMemory) != 0) {
+		vm.outOfMemory = NULL;
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	vm.outOfMemory = &outOfMemory;
+
 	ObjFunction* function = compile(source);
-	if (function == NULL) return INTERPRET_COMPILE_ERROR;
+	if (function == NULL) {
+		result = INTERPRET_COMPILE_ERROR;
+	}
+	else {
+		push(OBJ_VAL(function));
+		ObjClosure* closure = newClosure(function);
+		pop();
+		push(OBJ_VAL(closure));
+		call(closure, 0);
 
-	push(OBJ_VAL(function));
-	ObjClosure* closure = newClosure(function);
-	pop();
-	call(closure, 0);
+		result = run();
+	}
 
-	return run();
+	vm.outOfMemory = NULL;
+	return result;
 }
@@ -1,12 +1,22 @@
 #ifndef vlox_vm_h
 #define vlox_vm_h
 
+#include <setjmp.h>
+#include <stdatomic.h>
+
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
+#if ATOMIC_BOOL_LOCK_FREE != 2
+#error "vm.safepointRequested needs a lock-free atomic_bool."
+#endif
+
 #define FRAMES_MAX 64
 #define STACK_SLICE_SIZE 256
+// Each one is a thread of its own, kept around between collections.
+#define MARK_THREADS_MAX 64
 
 typedef struct {
 	ObjClosure* closure;
@@ -24,13 +34,46 @@ typedef struct {
 	Table globals;
 	Table strings;
 	ObjString* initString;
+	// Every one-character string, interned, so that s[i] needn't allocate.
+	ObjString* singleChars[UINT8_COUNT];
 	ObjUpvalue* openUpvalues;
-	size_t bytesAllocated;
-	size_t nextGC;
+	atomic_size_t bytesAllocated;
+	atomic_size_t nextGC;
 	Obj* objects;
+	Obj* regionObjects; // Allocated inside the open region, if any.
+	int regionDepth;
+	size_t promotedBytes;
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
+	bool sweepInBackground;
+	int markThreads;
+	bool markConcurrently;
+	bool isMarking;
+	// Also set from signal handlers, which may only store to lock-free
+	// atomics.
+	atomic_bool safepointRequested;
+	double compactionThreshold;
+	bool compactionRequested;
+	const char* gcPolicy;
+	double heapGrowthFactor;
+	size_t minHeap;
+	// Given on the command line or in the environment, so that policies
+	// leave them alone.
+	bool heapGrowthFactorGiven;
+	bool minHeapGiven;
+	size_t maxHeap;
+	size_t collections;
+	double trimInterval; // Seconds between trims, negative to never trim.
+	size_t trims;
+	const char* metricsPath;
+	size_t heapProfileRate;
+	const char* heapProfilePath;
+	const char* heapSnapshotPath;
+	jmp_buf* outOfMemory;
+	OutputBuffering outputBuffering;
+	size_t outputLength;
+	char output[OUTPUT_BUFFER_SIZE];
 } VM;
 
 extern VM vm;
@@ -46,6 +89,7 @@ void freeVM();
 InterpretResult interpret(const char*);
 void push(Value value);
 Value pop();
+void shrinkStack();
 
 void vmRuntimeError(const char*, ...);
 
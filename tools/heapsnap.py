@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Summarize a vlox heap snapshot.
+
+Reads the file written by writeHeapSnapshot() (or on SIGUSR2 with
+--heap-snapshot) and reports the objects that keep the most memory alive.
+An object's retained size is what would be freed if it went away: its own
+size plus everything it dominates, i.e. everything only reachable through
+it. For each of the biggest ones, a path from a root is shown.
+
+usage: heapsnap.py [-n COUNT] SNAPSHOT
+"""
+
+import argparse
+import collections
+import sys
+
+ROOT = "(roots)"
+
+
+def load(path):
+    objects = {}
+    edges = collections.defaultdict(list)
+    roots = []
+
+    with open(path, encoding="utf-8", errors="replace") as snapshot:
+        for line in snapshot:
+            line = line.rstrip("\n")
+            if not line or line.startswith("#"):
+                continue
+
+            kind, rest = line.split(" ", 1)
+            if kind == "object":
+                fields = rest.split(" ", 3)
+                label = fields[3] if len(fields) > 3 else ""
+                objects[fields[0]] = (fields[1], int(fields[2]), label)
+            elif kind == "edge":
+                source, target = rest.split(" ")
+                edges[source].append(target)
+            elif kind == "root":
+                target, label = rest.split(" ", 1)
+                roots.append((target, label))
+
+    edges[ROOT] = [target for target, _ in roots]
+    return objects, edges, roots
+
+
+def reverse_postorder(edges):
+    order = []
+    visited = {ROOT}
+    stack = [(ROOT, iter(edges[ROOT]))]
+
+    while stack:
+        node, children = stack[-1]
+        for child in children:
+            if child not in visited:
+                visited.add(child)
+                stack.append((child, iter(edges.get(child, ()))))
+                break
+        else:
+            stack.pop()
+            order.append(node)
+
+    order.reverse()
+    return order
+
+
+def dominators(edges, order):
+    """Cooper, Harvey and Kennedy's iterative algorithm."""
+    index = {node: i for i, node in enumerate(order)}
+    predecessors = collections.defaultdict(list)
+    for node in order:
+        for child in edges.get(node, ()):
+            predecessors[child].append(node)
+
+    idom = {ROOT: ROOT}
+
+    def intersect(a, b):
+        while a != b:
+            while index[a] > index[b]:
+                a = idom[a]
+            while index[b] > index[a]:
+                b = idom[b]
+        return a
+
+    changed = True
+    while changed:
+        changed = False
+        for node in order[1:]:
+            new = None
+            for pred in predecessors[node]:
+                if pred in idom:
+                    new = pred if new is None else intersect(pred, new)
+            if idom.get(node) != new:
+                idom[node] = new
+                changed = True
+
+    return idom
+
+
+def retained_sizes(objects, order, idom):
+    retained = {node: objects[node][1] if node in objects else 0 for node in order}
+    for node in reversed(order[1:]):
+        retained[idom[node]] += retained[node]
+    return retained
+
+
+def path_from_root(node, edges, roots, order):
+    """Shortest chain of references from a root to node."""
+    parent = {}
+    queue = collections.deque()
+    for target, label in roots:
+        if target not in parent:
+            parent[target] = (None, label)
+            queue.append(target)
+
+    while queue:
+        current = queue.popleft()
+        if current == node:
+            break
+        for child in edges.get(current, ()):
+            if child not in parent:
+                parent[child] = (current, None)
+                queue.append(child)
+
+    path = []
+    while node is not None and node in parent:
+        previous, label = parent[node]
+        path.append(node)
+        if previous is None:
+            path.append(label)
+        node = previous
+    path.reverse()
+    return path
+
+
+def describe(node, objects):
+    kind, size, label = objects[node]
+    return f"{kind} {label}".rstrip()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-n", "--count", type=int, default=10,
+                        help="how many objects to report (default: 10)")
+    parser.add_argument("snapshot")
+    args = parser.parse_args()
+
+    objects, edges, roots = load(args.snapshot)
+    order = reverse_postorder(edges)
+    idom = dominators(edges, order)
+    retained = retained_sizes(objects, order, idom)
+
+    reachable = len(order) - 1
+    total = sum(size for _, size, _ in objects.values())
+    print(f"{len(objects)} objects, {total} bytes; "
+          f"{reachable} reachable, {retained[ROOT]} bytes")
+
+    by_type = collections.defaultdict(lambda: [0, 0])
+    for kind, size, _ in objects.values():
+        by_type[kind][0] += 1
+        by_type[kind][1] += size
+    print("\nBy type:")
+    for kind, (count, size) in sorted(by_type.items(), key=lambda item: -item[1][1]):
+        print(f"  {size:>12} bytes {count:>9} {kind}")
+
+    print("\nRetained sizes:")
+    biggest = sorted((node for node in order[1:] if node in objects),
+                     key=lambda node: -retained[node])
+    for node in biggest[:args.count]:
+        print(f"  {retained[node]:>12} bytes (own {objects[node][1]}) "
+              f"{describe(node, objects)}")
+        path = path_from_root(node, edges, roots, order)
+        if path:
+            steps = [path[0]] + [describe(step, objects) for step in path[1:]]
+            print("      via " + " -> ".join(steps))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())